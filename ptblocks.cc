@@ -0,0 +1,208 @@
+/*
+ * libptformat - a library to read ProTools sessions
+ *
+ * Copyright (C) 2015  Damien Zammit
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include "ptformat/ptformat.h"
+#include <inttypes.h> // PRIxyy
+#include <cstdio>
+#include <cstring>
+#include <stdlib.h>
+#include <unistd.h>
+
+using namespace std;
+using std::string;
+
+#define OUTBUF	0x100000
+
+struct filter_t {
+	vector<uint16_t> types;		// empty for all
+	int maxdepth;			// -1 for all
+	uint64_t from, to;		// file offsets
+	bool hex;
+	uint32_t hexmax;		// 0 for all
+};
+
+static const unsigned char *image;
+
+/* Formats whole lines into one buffer, stdout is fully buffered too */
+static void
+hexdump(const unsigned char *p, uint32_t len, uint32_t addr, int level)
+{
+	static const char hex[] = "0123456789ABCDEF";
+	char line[512];
+	uint32_t i, j, end;
+	int n, k;
+
+	for (i = 0; i < len; i += 16) {
+		end = min(i + 16, len);
+		n = 0;
+		for (k = 0; k < level && k < 32; k++) {
+			memcpy(&line[n], "    ", 4);
+			n += 4;
+		}
+		n += sprintf(&line[n], "  %08x  ", addr + i);
+		for (j = i; j < i + 16; j++) {
+			if (j < end) {
+				line[n++] = hex[p[j] >> 4];
+				line[n++] = hex[p[j] & 0xf];
+			} else {
+				line[n++] = ' ';
+				line[n++] = ' ';
+			}
+			line[n++] = ' ';
+		}
+		line[n++] = ' ';
+		for (j = i; j < end; j++) {
+			line[n++] = (p[j] < 128 && p[j] > 32) ? p[j] : '.';
+		}
+		line[n++] = '\n';
+		fwrite(line, 1, n, stdout);
+	}
+}
+
+static bool
+wanted(filter_t const& f, uint16_t ctype)
+{
+	if (f.types.empty())
+		return true;
+	for (size_t i = 0; i < f.types.size(); i++) {
+		if (f.types[i] == ctype)
+			return true;
+	}
+	return false;
+}
+
+/* Blocks of a wanted type are shown with everything below them */
+static void
+show(filter_t const& f, PTFFormat::block_t const& b, int level, bool inside)
+{
+	uint64_t start = b.offset - 7;
+	uint64_t end = (uint64_t)b.offset + b.block_size;
+
+	if (f.maxdepth >= 0 && level > f.maxdepth)
+		return;
+	if (end <= f.from || start >= f.to)
+		return;
+
+	inside = inside || wanted(f, b.content_type);
+	if (inside) {
+		const char *desc = PTFFormat::content_description(b.content_type);
+		printf("%*s%s(0x%04x) @ 0x%08" PRIx64 ", 0x%x bytes, %zu children\n",
+			level * 4, "", desc ? desc : "UNKNOWN content type",
+			b.content_type, start, b.block_size, b.child.size());
+		if (f.hex) {
+			uint32_t len = b.block_size;
+			if (f.hexmax && len > f.hexmax)
+				len = f.hexmax;
+			hexdump(&image[b.offset], len, b.offset, level);
+		}
+	}
+	for (vector<PTFFormat::block_t>::const_iterator c = b.child.begin();
+			c != b.child.end(); ++c) {
+		show(f, *c, level + 1, inside);
+	}
+}
+
+static void
+usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-t type,...] [-d depth] [-o from[:to]] [-x [-n bytes]] file.pt{s,5,f,x}\n"
+		"       %s -l\n"
+		"Prints the block tree of a session.\n"
+		"  -t types  only blocks of these content types, and what is below them\n"
+		"  -d depth  nothing deeper than depth, 0 is the top level\n"
+		"  -o range  only blocks overlapping file offsets [from, to)\n"
+		"  -x        hexdump each block\n"
+		"  -n bytes  hexdump at most this much of each block (default 256, 0 all)\n"
+		"  -l        list the known content types\n", prog, prog);
+}
+
+int main (int argc, char **argv) {
+	PTFFormat ptf;
+	filter_t f;
+	char *p;
+	int c, ok;
+
+	f.maxdepth = -1;
+	f.from = 0;
+	f.to = UINT64_MAX;
+	f.hex = false;
+	f.hexmax = 256;
+
+	while ((c = getopt(argc, argv, "t:d:o:xn:lh")) != -1) {
+		switch (c) {
+		case 't':
+			for (p = optarg; *p; ) {
+				f.types.push_back((uint16_t)strtoul(p, &p, 16));
+				if (*p == ',')
+					p++;
+				else if (*p)
+					break;
+			}
+			break;
+		case 'd':
+			f.maxdepth = atoi(optarg);
+			break;
+		case 'o':
+			f.from = strtoull(optarg, &p, 0);
+			if (*p == ':')
+				f.to = strtoull(p + 1, NULL, 0);
+			break;
+		case 'x':
+			f.hex = true;
+			break;
+		case 'n':
+			f.hexmax = strtoul(optarg, NULL, 0);
+			break;
+		case 'l': {
+			uint32_t n;
+			const PTFFormat::content_desc_t *d = PTFFormat::content_descriptions(n);
+			for (uint32_t i = 0; i < n; i++)
+				printf("0x%04x %s\n", d[i].content_type, d[i].description);
+			exit(0);
+		}
+		default:
+			usage(argv[0]);
+			exit(1);
+		}
+	}
+
+	if (optind >= argc) {
+		usage(argv[0]);
+		exit(1);
+	}
+
+	ok = ptf.load_blocks(argv[optind]);
+	if (ok == -1) {
+		fprintf(stderr, "Cannot decrypt ptf, quit\n");
+		exit(1);
+	} else if (ok) {
+		fprintf(stderr, "Cannot extract version from ptf, quit\n");
+		exit(1);
+	}
+
+	setvbuf(stdout, NULL, _IOFBF, OUTBUF);
+	image = ptf.unxored_data();
+	for (vector<PTFFormat::block_t>::const_iterator b = ptf.blocktree().begin();
+			b != ptf.blocktree().end(); ++b) {
+		show(f, *b, 0, false);
+	}
+	exit(0);
+}
@@ -0,0 +1,833 @@
+/*
+ * libptformat - a library to read ProTools sessions
+ *
+ * Copyright (C) 2015  Damien Zammit
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include "ptformat/ptformat.h"
+#include "ptfreport.h"
+#include <inttypes.h> // PRIxyy
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <stdlib.h>
+#include <unistd.h>
+#include <glob.h>
+#include <sys/time.h>
+
+using namespace std;
+using std::string;
+
+/* Timings below this many microseconds are treated as noise */
+#define SLACK_US	200
+
+static const char *phase_names[] = {
+	"decrypt", "blocks", "audio", "regions", "tracks", "midi", "total"
+};
+#define NPHASES 7
+
+typedef vector<vector<string> > paragraphs;
+
+struct test_t {
+	string path;
+	string name;
+	string file;
+	string expect;
+};
+
+static int64_t
+now_us(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/* Notes when each phase is first reported, a phase lasts until the
+ * next one starts */
+class PhaseTimer : public PTFFormat::Progress {
+public:
+	int64_t start[NPHASES];
+
+	void reset () {
+		for (int i = 0; i < NPHASES; i++)
+			start[i] = -1;
+		start[PTFFormat::PhaseDecrypt] = now_us();
+	}
+	bool progress (PTFFormat::phase_t phase, uint64_t, uint64_t) {
+		if (start[phase] < 0)
+			start[phase] = now_us();
+		return true;
+	}
+	void finish (int64_t *us) {
+		int64_t end = now_us();
+		for (int i = NPHASES - 2; i >= 0; i--) {
+			if (start[i] < 0) {
+				us[i] = 0;
+				continue;
+			}
+			us[i] = end - start[i];
+			end = start[i];
+		}
+		us[NPHASES - 1] = 0;
+		for (int i = 0; i < NPHASES - 1; i++)
+			us[NPHASES - 1] += us[i];
+	}
+};
+
+/* Reads as src up to byte from, where reads start failing */
+class FailingSource : public PTFFormat::Source {
+public:
+	FailingSource (PTFFormat::Source& src, uint64_t from) : _src (src), _from (from) {}
+	int64_t size () { return _src.size(); }
+	int64_t read (uint64_t pos, void* buf, uint64_t n) {
+		if (pos >= _from)
+			return -1;
+		return _src.read(pos, buf, min(n, _from - pos));
+	}
+private:
+	PTFFormat::Source& _src;
+	uint64_t           _from;
+};
+
+/* Collects the MIDI events and regions of a visited load */
+class MidiVisitor : public PTFFormat::Visitor {
+public:
+	vector<vector<PTFFormat::midi_ev_t> > chunks;
+	vector<PTFFormat::region_t> regions;
+	vector<uint32_t> regionchunks;
+
+	void on_midi_event (uint32_t chunk, PTFFormat::midi_ev_t const& m) {
+		if (chunk >= chunks.size())
+			chunks.resize(chunk + 1);
+		chunks[chunk].push_back(m);
+	}
+	void on_midi_region (uint32_t chunk, PTFFormat::region_t const& r) {
+		regions.push_back(r);
+		regionchunks.push_back(chunk);
+	}
+};
+
+/* Whether the notes of each MIDI region, found through its chunk in
+ * a visited load that keeps no events, are those of a plain load */
+static bool
+visited_midi_matches(string const& file)
+{
+	PTFFormat ptf, visited;
+	MidiVisitor v;
+
+	ptf.load(file, 48000);
+	visited.load(file, 48000, v);
+	vector<PTFFormat::region_t> const& regions = ptf.midiregions();
+	if (v.regions.size() != regions.size())
+		return false;
+	for (size_t i = 0; i < regions.size(); i++) {
+		vector<PTFFormat::midi_ev_t> const& want = regions[i].midi;
+		uint32_t c = v.regionchunks[i];
+		if (c >= v.chunks.size()) {
+			if (!want.empty())
+				return false;
+			continue;
+		}
+		vector<PTFFormat::midi_ev_t> const& got = v.chunks[c];
+		if (got.size() != want.size())
+			return false;
+		for (size_t e = 0; e < want.size(); e++) {
+			if (got[e].pos != want[e].pos || got[e].length != want[e].length ||
+					got[e].note != want[e].note || got[e].velocity != want[e].velocity)
+				return false;
+		}
+	}
+	return true;
+}
+
+/* Reads NAME, FILE and EXPECT out of a tests/ script */
+static bool
+read_test(string const& path, test_t& t)
+{
+	FILE *fp;
+	string s;
+	char buf[4096];
+	size_t n, a, b;
+
+	if (!(fp = fopen(path.c_str(), "r")))
+		return false;
+	while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+		s.append(buf, n);
+	fclose(fp);
+
+	t.path = path;
+	if ((a = s.find("\nNAME=\"")) == string::npos ||
+			(b = s.find('"', a + 7)) == string::npos)
+		return false;
+	t.name = s.substr(a + 7, b - a - 7);
+	if ((a = s.find("\nFILE=")) == string::npos ||
+			(b = s.find('\n', a + 6)) == string::npos)
+		return false;
+	t.file = s.substr(a + 6, b - a - 6);
+	if ((a = s.find("\nEXPECT='")) == string::npos ||
+			(b = s.find('\'', a + 9)) == string::npos)
+		return false;
+	t.expect = s.substr(a + 9, b - a - 9);
+
+	/* FILE is relative to the directory of the test */
+	if (t.file[0] != '/' && (a = path.rfind('/')) != string::npos)
+		t.file = path.substr(0, a + 1) + t.file;
+	return true;
+}
+
+/* Blank line separated paragraphs, first line of each is its title */
+static paragraphs
+split(string const& text)
+{
+	paragraphs p(1);
+	size_t a = 0, b;
+
+	while (a <= text.size()) {
+		if ((b = text.find('\n', a)) == string::npos)
+			b = text.size();
+		string line = text.substr(a, b - a);
+		if (line.empty()) {
+			if (!p.back().empty())
+				p.push_back(vector<string>());
+		} else {
+			p.back().push_back(line);
+		}
+		a = b + 1;
+	}
+	if (p.back().empty())
+		p.pop_back();
+	return p;
+}
+
+/* Compares section by section and entry by entry, returns the number
+ * of differences */
+static int
+compare(paragraphs const& want, paragraphs const& got)
+{
+	size_t i, k, n = max(want.size(), got.size());
+	int diffs = 0;
+
+	for (i = 0; i < n; i++) {
+		if (i >= want.size()) {
+			printf("extra section `%s`\n", got[i][0].c_str());
+			diffs++;
+			continue;
+		}
+		if (i >= got.size()) {
+			printf("missing section `%s`\n", want[i][0].c_str());
+			diffs++;
+			continue;
+		}
+		if (want[i][0] != got[i][0]) {
+			printf("section %zu: expected `%s`\n  got `%s`\n", i,
+				want[i][0].c_str(), got[i][0].c_str());
+			diffs++;
+			continue;
+		}
+		for (k = 1; k < max(want[i].size(), got[i].size()); k++) {
+			if (k >= want[i].size()) {
+				printf("%s\n  extra entry %zu: %s\n", want[i][0].c_str(),
+					k - 1, got[i][k].c_str());
+			} else if (k >= got[i].size()) {
+				printf("%s\n  missing entry %zu: %s\n", want[i][0].c_str(),
+					k - 1, want[i][k].c_str());
+			} else if (want[i][k] != got[i][k]) {
+				printf("%s\n  entry %zu: expected %s\n  entry %zu: got      %s\n",
+					want[i][0].c_str(), k - 1, want[i][k].c_str(),
+					k - 1, got[i][k].c_str());
+			} else {
+				continue;
+			}
+			diffs++;
+		}
+	}
+	return diffs;
+}
+
+/* plugins(), iochannels() and routing() of each session in bins/, as
+ * read off the 0x1018, 0x1022 and 0x2603 blocks by hand */
+struct accessors_t {
+	const char *session;
+	const char *plugin;		// name of the only plugin, or NULL
+	const char *ids;		// its manufacturer, product, plugin
+	size_t      io[4];		// inputs, outputs, busses, inserts
+	size_t      channels[4];
+	size_t      paths, pathchannels;
+};
+
+static const accessors_t accessors[] = {
+	{ "Damien_monos.pts", NULL, NULL, { 6, 3, 24, 3 }, { 8, 4, 32, 4 }, 0, 0 },
+	{ "Fa_16_48.pts", NULL, NULL, { 6, 3, 24, 3 }, { 8, 4, 32, 4 }, 0, 0 },
+	{ "forArdour.pts", NULL, NULL, { 6, 3, 24, 3 }, { 8, 4, 32, 4 }, 0, 0 },
+	{ "goodplaylists2.ptf", "Polyphonic", "DigiFelPPoly", { 27, 27, 48, 27 }, { 36, 36, 64, 36 }, 0, 0 },
+	{ "midi345x.ptf", "Polyphonic", "DigiFelPPoly", { 6, 3, 32, 3 }, { 8, 4, 48, 4 }, 0, 0 },
+	{ "RegionTest.ptx", "Polyphonic", "DigiFelPPoly", { 1, 1, 45, 1 }, { 1, 2, 60, 1 }, 48, 64 },
+	{ "TestPTX.ptx", NULL, NULL, { 90, 33, 1, 90 }, { 120, 70, 2, 120 }, 23, 54 },
+};
+
+static string
+fourcc(uint32_t v)
+{
+	string s;
+
+	for (int i = 24; i >= 0; i -= 8)
+		s += (char)((v >> i) & 0xff);
+	return s;
+}
+
+/* Whether the accessors of the loaded session (at path, or member of an
+ * archive) give what accessors[] lists for it, true if it lists nothing */
+static bool
+accessors_match(PTFFormat& ptf, string const& path)
+{
+	string session = path.substr(path.rfind('/') + 1);
+	const accessors_t *a = NULL;
+	size_t io[4] = { 0 }, channels[4] = { 0 }, paths = 0, pathchannels = 0;
+	size_t i;
+
+	for (i = 0; i < sizeof(accessors) / sizeof(accessors[0]); i++) {
+		if (session == accessors[i].session)
+			a = &accessors[i];
+	}
+	if (!a)
+		return true;
+
+	vector<PTFFormat::plugin_t> const& plugins = ptf.plugins();
+	if (plugins.size() != (a->plugin ? 1 : 0))
+		return false;
+	if (a->plugin && (plugins[0].name != a->plugin ||
+			fourcc(plugins[0].manufacturer) + fourcc(plugins[0].product) +
+			fourcc(plugins[0].plugin) != a->ids))
+		return false;
+
+	vector<PTFFormat::io_t> const& ios = ptf.iochannels();
+	for (i = 0; i < ios.size(); i++) {
+		if (ios[i].kind > 3)
+			return false;
+		io[ios[i].kind]++;
+		channels[ios[i].kind] += ios[i].channels.size();
+	}
+	vector<PTFFormat::io_t> const& routes = ptf.routing();
+	for (i = 0; i < routes.size(); i++) {
+		paths++;
+		pathchannels += routes[i].channels.size();
+	}
+	return !memcmp(io, a->io, sizeof(io)) &&
+		!memcmp(channels, a->channels, sizeof(channels)) &&
+		paths == a->paths && pathchannels == a->pathchannels;
+}
+
+/* Compounds built by hand, as no session in bins/ has any */
+static void
+add_element(vector<PTFFormat::compound_t>& cs, uint32_t c,
+		int32_t region, int32_t compound, int64_t start, int64_t end)
+{
+	PTFFormat::compound_element_t e;
+
+	e.region = region;
+	e.compound = compound;
+	e.start = start;
+	e.end = end;
+	cs[c].elements.push_back(e);
+}
+
+/* flatten(cs, c) as "region@start region@start ..." */
+static string
+flattened(vector<PTFFormat::compound_t> const& cs, uint32_t c)
+{
+	vector<PTFFormat::compound_element_t> els = PTFFormat::flatten(cs, c);
+	string s;
+	char buf[64];
+
+	for (size_t k = 0; k < els.size(); k++) {
+		snprintf(buf, sizeof(buf), "%s%d@%" PRId64, k ? " " : "",
+			els[k].region, els[k].start);
+		s += buf;
+	}
+	return s;
+}
+
+static int
+check_compounds()
+{
+	vector<PTFFormat::compound_t> cs (7);
+	static const char *expect[] = {
+		"1@0 2@10",			// regions only
+		"3@0 1@100 2@110",		// nested
+		"1@0 2@10 1@50 2@60 3@200 1@300 2@310",	// shared
+		"1@0 2@10",			// cycle, cut below 4
+		"2@0 1@20",			// the same cycle, cut below 3
+		"1@0",				// refers to itself
+		"1@0 2@10 2@1000 1@1020",	// both ways into the cycle
+	};
+	int diffs = 0;
+
+	add_element(cs, 0, 1, -1, 0, 10);
+	add_element(cs, 0, 2, -1, 10, 20);
+	add_element(cs, 1, 3, -1, 0, 100);
+	add_element(cs, 1, -1, 0, 100, 120);
+	add_element(cs, 2, -1, 0, 0, 20);
+	add_element(cs, 2, -1, 0, 50, 70);
+	add_element(cs, 2, -1, 1, 200, 320);
+	add_element(cs, 3, 1, -1, 0, 10);
+	add_element(cs, 3, -1, 4, 10, 30);
+	add_element(cs, 4, 2, -1, 0, 20);
+	add_element(cs, 4, -1, 3, 20, 40);
+	add_element(cs, 5, 1, -1, 0, 10);
+	add_element(cs, 5, -1, 5, 10, 20);
+	add_element(cs, 6, -1, 3, 0, 30);
+	add_element(cs, 6, -1, 4, 1000, 1040);
+	add_element(cs, 6, -1, 7, 2000, 2010);	// unresolved
+
+	for (uint32_t c = 0; c < cs.size(); c++) {
+		string got = flattened(cs, c);
+		if (got != expect[c]) {
+			printf("compound %u: expected `%s', got `%s'\n",
+				c, expect[c], got.c_str());
+			diffs++;
+		}
+	}
+
+	/* Compound 1 placed at 1000 as a whole, then only 95 to 115 of
+	 * it, and a region cut short by the end of its element */
+	vector<PTFFormat::region_t> regions (4);
+	for (uint16_t r = 0; r < regions.size(); r++)
+		regions[r].index = r;
+	regions[1].length = 10;
+	regions[2].length = 10;
+	regions[2].sampleoffset = 50;
+	regions[3].length = 100;
+
+	static const char *placed[] = {
+		"3@1000+0,100 1@1100+0,10 2@1110+50,10",
+		"3@1000+95,5 1@1005+0,10 2@1015+50,5",
+		"3@1000+0,40 1@1040+0,10",
+	};
+	PTFFormat::track_t at;
+	at.reg.startpos = 1000;
+	for (int k = 0; k < 3; k++) {
+		vector<PTFFormat::compound_t> list (cs);
+		vector<PTFFormat::track_t> out;
+		string got;
+		char buf[64];
+
+		if (k == 1) {
+			list[1].sampleoffset = 95;
+			list[1].length = 20;
+		} else if (k == 2) {
+			list[1].elements.clear();
+			add_element(list, 1, 3, -1, 0, 40);
+			add_element(list, 1, 1, -1, 40, 50);
+		}
+		PTFFormat::place_compound(list[1], PTFFormat::flatten(list, 1), regions, at, out);
+		for (size_t i = 0; i < out.size(); i++) {
+			snprintf(buf, sizeof(buf), "%s%d@%" PRId64 "+%" PRId64 ",%" PRId64,
+				i ? " " : "", out[i].reg.index, out[i].reg.startpos,
+				out[i].reg.sampleoffset, out[i].reg.length);
+			got += buf;
+		}
+		if (got != placed[k]) {
+			printf("placement %d: expected `%s', got `%s'\n", k, placed[k], got.c_str());
+			diffs++;
+		}
+	}
+	return diffs;
+}
+
+/* Results compared field by field */
+static bool
+same_wav(PTFFormat::wav_t const& a, PTFFormat::wav_t const& b)
+{
+	return a.filename == b.filename && a.index == b.index &&
+		a.posabsolute == b.posabsolute && a.length == b.length;
+}
+
+static bool
+same_region(PTFFormat::region_t const& a, PTFFormat::region_t const& b)
+{
+	if (a.name != b.name || a.index != b.index || a.startpos != b.startpos ||
+			a.sampleoffset != b.sampleoffset || a.length != b.length ||
+			!same_wav(a.wave, b.wave) || a.midi.size() != b.midi.size())
+		return false;
+	for (size_t e = 0; e < a.midi.size(); e++) {
+		if (a.midi[e].pos != b.midi[e].pos || a.midi[e].length != b.midi[e].length ||
+				a.midi[e].note != b.midi[e].note || a.midi[e].velocity != b.midi[e].velocity)
+			return false;
+	}
+	return true;
+}
+
+static bool
+same_track(PTFFormat::track_t const& a, PTFFormat::track_t const& b)
+{
+	return a.name == b.name && a.index == b.index &&
+		a.playlist == b.playlist && same_region(a.reg, b.reg);
+}
+
+/* Prints the first difference */
+template <typename T> static bool
+same_list(const char *what, vector<T> const& a, vector<T> const& b, bool (*same)(T const&, T const&))
+{
+	if (a.size() != b.size()) {
+		printf("%s: %zu instead of %zu\n", what, a.size(), b.size());
+		return false;
+	}
+	for (size_t i = 0; i < a.size(); i++) {
+		if (!same(a[i], b[i])) {
+			printf("%s: entry %zu differs\n", what, i);
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool
+same_session(PTFFormat const& a, PTFFormat const& b)
+{
+	if (a.version() != b.version() || a.sessionrate() != b.sessionrate() ||
+			a.targetrate() != b.targetrate()) {
+		printf("version or rates differ\n");
+		return false;
+	}
+	return same_list("audio files", a.audiofiles(), b.audiofiles(), same_wav) &&
+		same_list("regions", a.regions(), b.regions(), same_region) &&
+		same_list("MIDI regions", a.midiregions(), b.midiregions(), same_region) &&
+		same_list("tracks", a.tracks(), b.tracks(), same_track) &&
+		same_list("MIDI tracks", a.miditracks(), b.miditracks(), same_track);
+}
+
+/* Writes a copy of session path to tmp, with the first letter of its
+ * first audio file (or MIDI region) name changed.  The session is XORed
+ * byte by byte, so flipping bits of the file flips them in the image. */
+static bool
+write_modified(string const& path, string& tmp)
+{
+	PTFFormat ptf;
+	vector<unsigned char> file;
+	unsigned char buf[4096];
+	string name;
+	size_t n;
+	FILE *fp;
+
+	if (ptf.load(path, 48000))
+		return false;
+	if (!ptf.audiofiles().empty())
+		name = ptf.audiofiles()[0].filename;
+	else if (!ptf.midiregions().empty())
+		name = ptf.midiregions()[0].name;
+	if (name.empty())
+		return false;
+
+	const unsigned char *image = ptf.unxored_data();
+	const unsigned char *end = image + ptf.unxored_size();
+	const unsigned char *at = search(image, end, name.begin(), name.end());
+	if (at == end)
+		return false;
+
+	if (!(fp = fopen(path.c_str(), "rb")))
+		return false;
+	while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+		file.insert(file.end(), buf, buf + n);
+	fclose(fp);
+	if (file.size() != ptf.unxored_size())
+		return false;
+	file[at - image] ^= *at ^ (*at == 'Q' ? 'R' : 'Q');
+
+	char tmpl[] = "/tmp/ptcheck-XXXXXX";
+	int fd = mkstemp(tmpl);
+	if (fd < 0)
+		return false;
+	tmp = tmpl;
+	n = write(fd, &file[0], file.size());
+	close(fd);
+	return n == file.size();
+}
+
+/* Reloads each session into one PTFFormat, then a modified copy of it,
+ * then the session again, and checks every result against a fresh
+ * load().  Returns the number of differences */
+static int
+check_reloads(vector<string> const& sessions)
+{
+	vector<string> chain, tmps;
+	PTFFormat chained;
+	int diffs = 0;
+	size_t i;
+
+	for (i = 0; i < sessions.size(); i++) {
+		string tmp;
+		chain.push_back(sessions[i]);
+		if (write_modified(sessions[i], tmp)) {
+			tmps.push_back(tmp);
+			chain.push_back(tmp);
+			chain.push_back(sessions[i]);
+		} else {
+			printf("%s: cannot write a modified copy\n", sessions[i].c_str());
+			diffs++;
+		}
+	}
+
+	for (i = 0; i < chain.size(); i++) {
+		PTFFormat fresh;
+		int want = fresh.load(chain[i], 48000);
+		int got = chained.reload(chain[i], 48000);
+		if (got != want) {
+			printf("%s: reload returned %d instead of %d\n", chain[i].c_str(), got, want);
+			diffs++;
+		} else if (!same_session(chained, fresh)) {
+			printf("%s: reloaded after %s\n", chain[i].c_str(),
+				i ? chain[i - 1].c_str() : "nothing");
+			diffs++;
+		}
+	}
+
+	for (i = 0; i < tmps.size(); i++)
+		unlink(tmps[i].c_str());
+	return diffs;
+}
+
+typedef vector<pair<string, int64_t> > baseline_t;
+
+static bool
+read_baseline(string const& path, baseline_t& base)
+{
+	FILE *fp;
+	char line[1024];
+
+	if (!(fp = fopen(path.c_str(), "r")))
+		return false;
+	while (fgets(line, sizeof(line), fp)) {
+		char *tab = strrchr(line, '\t');
+		if (!tab)
+			continue;
+		*tab = '\0';
+		base.push_back(make_pair(string(line), (int64_t)strtoll(tab + 1, NULL, 10)));
+	}
+	fclose(fp);
+	return true;
+}
+
+static int64_t
+baseline_of(baseline_t const& base, string const& key)
+{
+	for (baseline_t::const_iterator i = base.begin(); i != base.end(); ++i) {
+		if (i->first == key)
+			return i->second;
+	}
+	return -1;
+}
+
+static void
+usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-r runs] [-j jobs [-s bytes]] [-p] [-a bytes] [-b baseline [-t percent]] [-w baseline] [test ...]\n"
+		"Loads the session of every test (default tests/*/*) in process and\n"
+		"compares the results with its EXPECT section.\n"
+		"  -r runs      loads per test, the fastest is kept (default 3)\n"
+		"  -j jobs      threads each load may use (default 1)\n"
+		"  -s bytes     use them for sessions of this many bytes up (0 for all)\n"
+		"  -p           pipelined loads, decrypting while scanning blocks\n"
+		"  -a bytes     read sessions ahead in blocks of bytes\n"
+		"  -b baseline  fail phases slower than in baseline\n"
+		"  -t percent   slowdown allowed against the baseline (default 25)\n"
+		"  -w baseline  write the timings measured as a new baseline\n", prog);
+}
+
+int main (int argc, char **argv) {
+	vector<string> paths, sessions;
+	baseline_t base;
+	string basefile, outfile;
+	int runs = 3, jobs = 1, percent = 25, failed = 0, c;
+	bool pipelined = false;
+	uint32_t readahead = 0;
+	int64_t parallel = -1;
+	FILE *out = NULL;
+
+	while ((c = getopt(argc, argv, "r:j:s:pa:b:t:w:h")) != -1) {
+		switch (c) {
+		case 'r':
+			runs = max(1, atoi(optarg));
+			break;
+		case 'j':
+			jobs = max(1, atoi(optarg));
+			break;
+		case 's':
+			parallel = max((int64_t)0, (int64_t)strtoll(optarg, NULL, 10));
+			break;
+		case 'p':
+			pipelined = true;
+			break;
+		case 'a':
+			readahead = max(1, atoi(optarg));
+			break;
+		case 'b':
+			basefile = optarg;
+			break;
+		case 't':
+			percent = atoi(optarg);
+			break;
+		case 'w':
+			outfile = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			exit(2);
+		}
+	}
+
+	if (optind < argc) {
+		paths.assign(argv + optind, argv + argc);
+	} else {
+		glob_t g;
+		if (glob("tests/*/*", 0, NULL, &g) == 0)
+			paths.assign(g.gl_pathv, g.gl_pathv + g.gl_pathc);
+		globfree(&g);
+	}
+	if (paths.empty()) {
+		fprintf(stderr, "No tests found\n");
+		exit(2);
+	}
+	if (!basefile.empty() && !read_baseline(basefile, base)) {
+		fprintf(stderr, "Cannot read baseline %s\n", basefile.c_str());
+		exit(2);
+	}
+	if (!outfile.empty() && !(out = fopen(outfile.c_str(), "w"))) {
+		fprintf(stderr, "Cannot write baseline %s\n", outfile.c_str());
+		exit(2);
+	}
+
+	printf("Compound regions\n");
+	if (check_compounds()) {
+		printf("[FAIL]\n\n");
+		failed++;
+	} else {
+		printf("[ OK ]\n\n");
+	}
+
+	for (vector<string>::const_iterator p = paths.begin(); p != paths.end(); ++p) {
+		test_t t;
+		PhaseTimer timer;
+		int64_t best[NPHASES], us[NPHASES];
+		int diffs = 0;
+
+		if (!read_test(*p, t)) {
+			printf("%s\nCannot read test\n[FAIL]\n\n", p->c_str());
+			failed++;
+			continue;
+		}
+		printf("%s\n", t.name.c_str());
+		if (access(t.file.c_str(), R_OK)) {
+			printf("Cannot find test file\n[FAIL]\n\n");
+			failed++;
+			continue;
+		}
+
+		for (int r = 0; r < runs; r++) {
+			PTFFormat ptf;
+			PTFFormat::FileSource file (t.file);
+			PTFFormat::ArchiveSource archive (file);
+			PTFFormat::Source& in = archive.archive() ? (PTFFormat::Source&) archive : file;
+			int ok;
+
+			ptf.set_progress(&timer);
+			ptf.set_jobs(jobs);
+			if (parallel >= 0)
+				ptf.set_parallel_bytes(parallel);
+			ptf.set_pipelined(pipelined);
+			timer.reset();
+			if (readahead) {
+				PTFFormat::ReadAheadSource src (in, readahead);
+				ok = ptf.load(src, 48000);
+			} else if (archive.archive()) {
+				ok = ptf.load(archive, 48000);
+			} else {
+				ok = ptf.load(t.file, 48000);
+			}
+			timer.finish(us);
+			for (int i = 0; i < NPHASES; i++)
+				best[i] = r ? min(best[i], us[i]) : us[i];
+			if (r == 0) {
+				diffs = compare(split(t.expect), split(ptf_report(ptf, ok, 48000)));
+				if (!accessors_match(ptf, archive.archive() ? archive.member() : t.file)) {
+					printf("Plugins or I/O differ\n");
+					diffs++;
+				}
+			}
+		}
+
+		/* A source failing halfway must fail the load */
+		{
+			PTFFormat ptf;
+			PTFFormat::FileSource file (t.file);
+			PTFFormat::ArchiveSource archive (file);
+			PTFFormat::Source& in = archive.archive() ? (PTFFormat::Source&) archive : file;
+			FailingSource src (in, in.size() / 2);
+
+			ptf.set_jobs(jobs);
+			if (parallel >= 0)
+				ptf.set_parallel_bytes(parallel);
+			ptf.set_pipelined(pipelined);
+			if (ptf.load(src, 48000) != -1) {
+				printf("Read error not reported\n");
+				diffs++;
+			}
+			if (!archive.archive() && !visited_midi_matches(t.file)) {
+				printf("Visited MIDI regions lost their notes\n");
+				diffs++;
+			}
+			if (!archive.archive())
+				sessions.push_back(t.file);
+		}
+
+		for (int i = 0; i < NPHASES; i++) {
+			string key = t.name + "\t" + phase_names[i];
+			int64_t b = baseline_of(base, key);
+			printf("%s %" PRId64 "us", phase_names[i], best[i]);
+			if (b >= 0) {
+				printf(" (%" PRId64 "us)", b);
+				if (best[i] > b + b * percent / 100 + SLACK_US) {
+					printf(" SLOWER");
+					diffs++;
+				}
+			}
+			printf(i == NPHASES - 1 ? "\n" : ", ");
+			if (out)
+				fprintf(out, "%s\t%" PRId64 "\n", key.c_str(), best[i]);
+		}
+
+		if (diffs) {
+			printf("[FAIL]\n\n");
+			failed++;
+		} else {
+			printf("[ OK ]\n\n");
+		}
+	}
+
+	printf("Reloads\n");
+	if (check_reloads(sessions)) {
+		printf("[FAIL]\n\n");
+		failed++;
+	} else {
+		printf("[ OK ]\n\n");
+	}
+
+	if (out)
+		fclose(out);
+	exit(failed);
+}
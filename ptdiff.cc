@@ -0,0 +1,333 @@
+/*
+ * libptformat - a library to read ProTools sessions
+ *
+ * Copyright (C) 2015  Damien Zammit
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include "ptformat/ptformat.h"
+#include <inttypes.h> // PRIxyy
+#include <cstdio>
+#include <stdlib.h>
+
+using namespace std;
+using std::string;
+
+typedef vector<pair<uint16_t, uint64_t> > hashlist;
+
+/* Top-level content types each report is built from */
+static const uint16_t wav_blocks[] = { 0x1004 };
+static const uint16_t region_blocks[] = { 0x1004, 0x100b, 0x262a };
+static const uint16_t track_blocks[] = { 0x1004, 0x100b, 0x262a, 0x1015, 0x1012, 0x1054 };
+static const uint16_t midi_blocks[] = { 0x2000, 0x2002, 0x2634, 0x262c, 0x2519, 0x1015, 0x1058 };
+
+#define N_ELEMENTS(a) (sizeof (a) / sizeof (a[0]))
+
+static bool
+same_blocks(hashlist const& a, hashlist const& b, const uint16_t *types, size_t n)
+{
+	hashlist fa, fb;
+	size_t i, k;
+
+	for (i = 0; i < a.size(); i++) {
+		for (k = 0; k < n; k++) {
+			if (a[i].first == types[k]) {
+				fa.push_back(a[i]);
+			}
+		}
+	}
+	for (i = 0; i < b.size(); i++) {
+		for (k = 0; k < n; k++) {
+			if (b[i].first == types[k]) {
+				fb.push_back(b[i]);
+			}
+		}
+	}
+	return fa == fb;
+}
+
+/* Entries are paired on all the fields reported, anything left
+ * unpaired on either side is reported as removed or added */
+static int
+cmp_wav(PTFFormat::wav_t const& a, PTFFormat::wav_t const& b)
+{
+	int c = a.filename.compare(b.filename);
+	if (c)
+		return c;
+	return a.length < b.length ? -1 : a.length > b.length;
+}
+
+static bool
+wav_less(PTFFormat::wav_t const& a, PTFFormat::wav_t const& b)
+{
+	return cmp_wav(a, b) < 0;
+}
+
+static int
+cmp_region(PTFFormat::region_t const& a, PTFFormat::region_t const& b)
+{
+	int c = a.name.compare(b.name);
+	if (c)
+		return c;
+	if ((c = a.wave.filename.compare(b.wave.filename)))
+		return c;
+	if (a.sampleoffset != b.sampleoffset)
+		return a.sampleoffset < b.sampleoffset ? -1 : 1;
+	return a.length < b.length ? -1 : a.length > b.length;
+}
+
+static bool
+region_less(PTFFormat::region_t const& a, PTFFormat::region_t const& b)
+{
+	return cmp_region(a, b) < 0;
+}
+
+/* MIDI regions are paired by name, their notes are then compared */
+static bool
+midiregion_less(PTFFormat::region_t const& a, PTFFormat::region_t const& b)
+{
+	return a.name < b.name;
+}
+
+static int
+cmp_track(PTFFormat::track_t const& a, PTFFormat::track_t const& b)
+{
+	int c = a.name.compare(b.name);
+	if (c)
+		return c;
+	if ((c = a.reg.name.compare(b.reg.name)))
+		return c;
+	return a.reg.startpos < b.reg.startpos ? -1 : a.reg.startpos > b.reg.startpos;
+}
+
+static bool
+track_less(PTFFormat::track_t const& a, PTFFormat::track_t const& b)
+{
+	return cmp_track(a, b) < 0;
+}
+
+static bool
+note_less(PTFFormat::midi_ev_t const& a, PTFFormat::midi_ev_t const& b)
+{
+	if (a.pos != b.pos)
+		return a.pos < b.pos;
+	if (a.note != b.note)
+		return a.note < b.note;
+	if (a.length != b.length)
+		return a.length < b.length;
+	return a.velocity < b.velocity;
+}
+
+static int
+diff_wavs(vector<PTFFormat::wav_t> a, vector<PTFFormat::wav_t> b)
+{
+	vector<PTFFormat::wav_t>::iterator i, j;
+	int n = 0;
+
+	sort(a.begin(), a.end(), wav_less);
+	sort(b.begin(), b.end(), wav_less);
+
+	for (i = a.begin(), j = b.begin(); i != a.end() || j != b.end(); n++) {
+		int c = (i == a.end()) ? 1 : (j == b.end()) ? -1 : cmp_wav(*i, *j);
+		if (c < 0) {
+			printf("- wav `%s` %" PRId64 "\n", i->filename.c_str(), i->length);
+			++i;
+		} else if (c > 0) {
+			printf("+ wav `%s` %" PRId64 "\n", j->filename.c_str(), j->length);
+			++j;
+		} else {
+			n--;
+			++i;
+			++j;
+		}
+	}
+	return n;
+}
+
+static int
+diff_regions(vector<PTFFormat::region_t> a, vector<PTFFormat::region_t> b)
+{
+	vector<PTFFormat::region_t>::iterator i, j;
+	int n = 0;
+
+	sort(a.begin(), a.end(), region_less);
+	sort(b.begin(), b.end(), region_less);
+
+	for (i = a.begin(), j = b.begin(); i != a.end() || j != b.end(); n++) {
+		int c = (i == a.end()) ? 1 : (j == b.end()) ? -1 : cmp_region(*i, *j);
+		if (c < 0) {
+			printf("- region `%s` (%s) @ %" PRId64 ", %" PRId64 "\n",
+				i->name.c_str(), i->wave.filename.c_str(),
+				i->sampleoffset, i->length);
+			++i;
+		} else if (c > 0) {
+			printf("+ region `%s` (%s) @ %" PRId64 ", %" PRId64 "\n",
+				j->name.c_str(), j->wave.filename.c_str(),
+				j->sampleoffset, j->length);
+			++j;
+		} else {
+			n--;
+			++i;
+			++j;
+		}
+	}
+	return n;
+}
+
+static int
+diff_tracks(const char *what, vector<PTFFormat::track_t> a, vector<PTFFormat::track_t> b)
+{
+	vector<PTFFormat::track_t>::iterator i, j;
+	int n = 0;
+
+	sort(a.begin(), a.end(), track_less);
+	sort(b.begin(), b.end(), track_less);
+
+	for (i = a.begin(), j = b.begin(); i != a.end() || j != b.end(); n++) {
+		int c = (i == a.end()) ? 1 : (j == b.end()) ? -1 : cmp_track(*i, *j);
+		if (c < 0) {
+			printf("- %s `%s` `%s` @ %" PRId64 "\n", what,
+				i->name.c_str(), i->reg.name.c_str(), i->reg.startpos);
+			++i;
+		} else if (c > 0) {
+			printf("+ %s `%s` `%s` @ %" PRId64 "\n", what,
+				j->name.c_str(), j->reg.name.c_str(), j->reg.startpos);
+			++j;
+		} else {
+			n--;
+			++i;
+			++j;
+		}
+	}
+	return n;
+}
+
+static int
+diff_notes(string const& name, vector<PTFFormat::midi_ev_t> a, vector<PTFFormat::midi_ev_t> b)
+{
+	vector<PTFFormat::midi_ev_t>::iterator i, j;
+	int n = 0;
+
+	sort(a.begin(), a.end(), note_less);
+	sort(b.begin(), b.end(), note_less);
+
+	for (i = a.begin(), j = b.begin(); i != a.end() || j != b.end(); n++) {
+		if (j == b.end() || (i != a.end() && note_less(*i, *j))) {
+			printf("- note `%s` n(%d) v(%d) @ %" PRIu64 ", %" PRIu64 "\n",
+				name.c_str(), i->note, i->velocity, i->pos, i->length);
+			++i;
+		} else if (i == a.end() || note_less(*j, *i)) {
+			printf("+ note `%s` n(%d) v(%d) @ %" PRIu64 ", %" PRIu64 "\n",
+				name.c_str(), j->note, j->velocity, j->pos, j->length);
+			++j;
+		} else {
+			n--;
+			++i;
+			++j;
+		}
+	}
+	return n;
+}
+
+static int
+diff_midiregions(vector<PTFFormat::region_t> a, vector<PTFFormat::region_t> b)
+{
+	vector<PTFFormat::region_t>::iterator i, j;
+	int n = 0;
+
+	sort(a.begin(), a.end(), midiregion_less);
+	sort(b.begin(), b.end(), midiregion_less);
+
+	for (i = a.begin(), j = b.begin(); i != a.end() || j != b.end(); ) {
+		int c = (i == a.end()) ? 1 : (j == b.end()) ? -1 : i->name.compare(j->name);
+		if (c < 0) {
+			printf("- midiregion `%s` %zu notes\n", i->name.c_str(), i->midi.size());
+			++i;
+			n++;
+		} else if (c > 0) {
+			printf("+ midiregion `%s` %zu notes\n", j->name.c_str(), j->midi.size());
+			++j;
+			n++;
+		} else {
+			n += diff_notes(i->name, i->midi, j->midi);
+			++i;
+			++j;
+		}
+	}
+	return n;
+}
+
+int main (int argc, char **argv) {
+	PTFFormat a, b;
+	hashlist ha, hb;
+	int changes = 0;
+
+	if (argc < 3) {
+		fprintf(stderr, "Usage: %s old.ptx new.ptx\n", argv[0]);
+		exit(2);
+	}
+
+	/* Both at once, each at its own rate so that positions are exact */
+	a.load_async(argv[1], 0);
+	b.load_async(argv[2], 0);
+	int erra = a.wait();
+	int errb = b.wait();
+	if (erra) {
+		fprintf(stderr, "Cannot load %s\n", argv[1]);
+		exit(2);
+	}
+	if (errb) {
+		fprintf(stderr, "Cannot load %s\n", argv[2]);
+		exit(2);
+	}
+
+	a.blockhashes(ha);
+	b.blockhashes(hb);
+
+	if (ha == hb && a.sessionrate() == b.sessionrate()) {
+		exit(0);
+	}
+
+	if (a.version() != b.version()) {
+		printf("~ version %d -> %d\n", a.version(), b.version());
+		changes++;
+	}
+	if (a.sessionrate() != b.sessionrate()) {
+		printf("~ samplerate %" PRId64 " -> %" PRId64 "\n", a.sessionrate(), b.sessionrate());
+		changes++;
+	}
+
+	/* Only compare what can have changed.  Positions are in session
+	 * samples, so a rate change changes them all */
+	bool rate = a.sessionrate() == b.sessionrate();
+
+	if (!rate || !same_blocks(ha, hb, wav_blocks, N_ELEMENTS(wav_blocks))) {
+		changes += diff_wavs(a.audiofiles(), b.audiofiles());
+	}
+	if (!rate || !same_blocks(ha, hb, region_blocks, N_ELEMENTS(region_blocks))) {
+		changes += diff_regions(a.regions(), b.regions());
+	}
+	if (!rate || !same_blocks(ha, hb, track_blocks, N_ELEMENTS(track_blocks))) {
+		changes += diff_tracks("track", a.tracks(), b.tracks());
+	}
+	if (!rate || !same_blocks(ha, hb, midi_blocks, N_ELEMENTS(midi_blocks))) {
+		changes += diff_midiregions(a.midiregions(), b.midiregions());
+		changes += diff_tracks("miditrack", a.miditracks(), b.miditracks());
+	}
+
+	exit(changes ? 1 : 0);
+}
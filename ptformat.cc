@@ -25,6 +25,12 @@
 #include <string>
 #include <string.h>
 #include <assert.h>
+#include <map>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 
 #ifdef HAVE_GLIB
 # include <glib/gstdio.h>
@@ -33,6 +39,10 @@
 # define ptf_open	fopen
 #endif
 
+#ifdef HAVE_ZLIB
+# include <zlib.h>
+#endif
+
 #include "ptformat/ptformat.h"
 
 #define BITCODE			"0010111100101011"
@@ -40,6 +50,9 @@
 #define ZERO_TICKS		0xe8d4a51000ULL
 #define MAX_CONTENT_TYPE	0x3000
 #define MAX_CHANNELS_PER_TRACK	8
+#define DECRYPT_CHUNK		0x10000
+#define STREAM_CHUNK		0x100000
+#define PARALLEL_BLOCK_BYTES	0x40000	// default for set_parallel_bytes()
 
 #if 0
 #define DEBUG
@@ -56,23 +69,29 @@ using namespace std;
 static void
 hexdump(uint8_t *data, int length, int level)
 {
-	int i,j,k,end,step=16;
+	static const char hex[] = "0123456789ABCDEF";
+	char line[256];
+	int i,j,k,n,end,step=16;
 
+	/* One write per line rather than one per byte */
 	for (i = 0; i < length; i += step) {
 		end = i + step;
 		if (end > length) end = length;
-		for (k = 0; k < level; k++)
-			printf("    ");
+		n = 0;
+		for (k = 0; k < level && n < 200; k++) {
+			memcpy(&line[n], "    ", 4);
+			n += 4;
+		}
 		for (j = i; j < end; j++) {
-			printf("%02X ", data[j]);
+			line[n++] = hex[data[j] >> 4];
+			line[n++] = hex[data[j] & 0xf];
+			line[n++] = ' ';
 		}
 		for (j = i; j < end; j++) {
-			if (data[j] < 128 && data[j] > 32)
-				printf("%c", data[j]);
-			else
-				printf(".");
+			line[n++] = (data[j] < 128 && data[j] > 32) ? data[j] : '.';
 		}
-		printf("\n");
+		line[n++] = '\n';
+		fwrite(line, 1, n, stdout);
 	}
 }
 
@@ -85,107 +104,114 @@ PTFFormat::PTFFormat()
 	, _targetrate (0)
 	, _ratefactor (1.0)
 	, is_bigendian(false)
+	, _plugins_done(false)
+	, _iochannels_done(false)
+	, _routing_done(false)
+	, _prev(NULL)
+	, _visitor(NULL)
+	, _keep_events(true)
+	, _progress(NULL)
+	, _jobs(1)
+	, _parallel_bytes(PARALLEL_BLOCK_BYTES)
+	, _pipelined(false)
+	, _pipe(NULL)
+	, _decrypted(true)
+	, _budget_ms(0)
+	, _start_ms(0)
+	, _partial(false)
+	, _cancel(false)
+	, _async(NULL)
 {
 }
 
 PTFFormat::~PTFFormat() {
+	if (_async) {
+		cancel();
+		wait();
+	}
 	cleanup();
 }
 
+/* Known content types, in content type order */
+const PTFFormat::content_desc_t PTFFormat::content_types[] = {
+	{ 0x0030, "INFO product and version" },
+	{ 0x1001, "WAV samplerate, size" },
+	{ 0x1003, "WAV metadata" },
+	{ 0x1004, "WAV list full" },
+	{ 0x1007, "region name, number" },
+	{ 0x1008, "AUDIO region name, number (v5)" },
+	{ 0x100b, "AUDIO region list (v5)" },
+	{ 0x100f, "AUDIO region->track entry" },
+	{ 0x1011, "AUDIO region->track map entries" },
+	{ 0x1012, "AUDIO region->track full map" },
+	{ 0x1014, "AUDIO track name, number" },
+	{ 0x1015, "AUDIO tracks" },
+	{ 0x1017, "PLUGIN entry" },
+	{ 0x1018, "PLUGIN full list" },
+	{ 0x1021, "I/O channel entry" },
+	{ 0x1022, "I/O channel list" },
+	{ 0x1028, "INFO sample rate" },
+	{ 0x103a, "WAV names" },
+	{ 0x104f, "AUDIO region->track subentry (v8)" },
+	{ 0x1050, "AUDIO region->track entry (v8)" },
+	{ 0x1052, "AUDIO region->track map entries (v8)" },
+	{ 0x1054, "AUDIO region->track full map (v8)" },
+	{ 0x1056, "MIDI region->track entry" },
+	{ 0x1057, "MIDI region->track map entries" },
+	{ 0x1058, "MIDI region->track full map" },
+	{ 0x2000, "MIDI events block" },
+	{ 0x2001, "MIDI region name, number (v5)" },
+	{ 0x2002, "MIDI regions map (v5)" },
+	{ 0x2067, "INFO path of session" },
+	{ 0x2511, "Snaps block" },
+	{ 0x2519, "MIDI track full list" },
+	{ 0x251a, "MIDI track name, number" },
+	{ 0x2523, "COMPOUND region element" },
+	{ 0x2602, "I/O route" },
+	{ 0x2603, "I/O routing table" },
+	{ 0x2628, "COMPOUND region group" },
+	{ 0x2629, "AUDIO region name, number (v10)" },
+	{ 0x262a, "AUDIO region list (v10)" },
+	{ 0x262c, "COMPOUND region full map" },
+	{ 0x2633, "MIDI regions name, number (v10)" },
+	{ 0x2634, "MIDI regions map (v10)" },
+	{ 0x271a, "MARKER list" },
+};
+
+const char *
+PTFFormat::content_description(uint16_t ctype) {
+	uint32_t lo = 0, hi = sizeof(content_types) / sizeof(content_types[0]);
+
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (content_types[mid].content_type == ctype)
+			return content_types[mid].description;
+		if (content_types[mid].content_type < ctype)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return NULL;
+}
+
+const PTFFormat::content_desc_t *
+PTFFormat::content_descriptions(uint32_t& n) {
+	n = sizeof(content_types) / sizeof(content_types[0]);
+	return content_types;
+}
+
 const std::string
 PTFFormat::get_content_description(uint16_t ctype) {
-	switch(ctype) {
-	case 0x0030:
-		return std::string("INFO product and version");
-	case 0x1001:
-		return std::string("WAV samplerate, size");
-	case 0x1003:
-		return std::string("WAV metadata");
-	case 0x1004:
-		return std::string("WAV list full");
-	case 0x1007:
-		return std::string("region name, number");
-	case 0x1008:
-		return std::string("AUDIO region name, number (v5)");
-	case 0x100b:
-		return std::string("AUDIO region list (v5)");
-	case 0x100f:
-		return std::string("AUDIO region->track entry");
-	case 0x1011:
-		return std::string("AUDIO region->track map entries");
-	case 0x1012:
-		return std::string("AUDIO region->track full map");
-	case 0x1014:
-		return std::string("AUDIO track name, number");
-	case 0x1015:
-		return std::string("AUDIO tracks");
-	case 0x1017:
-		return std::string("PLUGIN entry");
-	case 0x1018:
-		return std::string("PLUGIN full list");
-	case 0x1021:
-		return std::string("I/O channel entry");
-	case 0x1022:
-		return std::string("I/O channel list");
-	case 0x1028:
-		return std::string("INFO sample rate");
-	case 0x103a:
-		return std::string("WAV names");
-	case 0x104f:
-		return std::string("AUDIO region->track subentry (v8)");
-	case 0x1050:
-		return std::string("AUDIO region->track entry (v8)");
-	case 0x1052:
-		return std::string("AUDIO region->track map entries (v8)");
-	case 0x1054:
-		return std::string("AUDIO region->track full map (v8)");
-	case 0x1056:
-		return std::string("MIDI region->track entry");
-	case 0x1057:
-		return std::string("MIDI region->track map entries");
-	case 0x1058:
-		return std::string("MIDI region->track full map");
-	case 0x2000:
-		return std::string("MIDI events block");
-	case 0x2001:
-		return std::string("MIDI region name, number (v5)");
-	case 0x2002:
-		return std::string("MIDI regions map (v5)");
-	case 0x2067:
-		return std::string("INFO path of session");
-	case 0x2511:
-		return std::string("Snaps block");
-	case 0x2519:
-		return std::string("MIDI track full list");
-	case 0x251a:
-		return std::string("MIDI track name, number");
-	case 0x2523:
-		return std::string("COMPOUND region element");
-	case 0x2602:
-		return std::string("I/O route");
-	case 0x2603:
-		return std::string("I/O routing table");
-	case 0x2628:
-		return std::string("COMPOUND region group");
-	case 0x2629:
-		return std::string("AUDIO region name, number (v10)");
-	case 0x262a:
-		return std::string("AUDIO region list (v10)");
-	case 0x262c:
-		return std::string("COMPOUND region full map");
-	case 0x2633:
-		return std::string("MIDI regions name, number (v10)");
-	case 0x2634:
-		return std::string("MIDI regions map (v10)");
-	case 0x271a:
-		return std::string("MARKER list");
-	default:
-		return std::string("UNKNOWN content type");
-	}
+	const char *d = content_description(ctype);
+	return std::string(d ? d : "UNKNOWN content type");
 }
 
-static uint16_t
-u_endian_read2(unsigned char *buf, bool bigendian)
+/* Byte order is a template parameter so that the parser hot paths, which
+ * are instantiated once per byte order, read fields without branching.
+ * The variants taking a runtime flag are for everything else.
+ */
+template <bool bigendian> static inline uint16_t
+u_endian_read2(const unsigned char *buf)
 {
 	if (bigendian) {
 		return ((uint16_t)(buf[0]) << 8) | (uint16_t)(buf[1]);
@@ -194,8 +220,8 @@ u_endian_read2(unsigned char *buf, bool bigendian)
 	}
 }
 
-static uint32_t
-u_endian_read3(unsigned char *buf, bool bigendian)
+template <bool bigendian> static inline uint32_t
+u_endian_read3(const unsigned char *buf)
 {
 	if (bigendian) {
 		return ((uint32_t)(buf[0]) << 16) |
@@ -208,8 +234,8 @@ u_endian_read3(unsigned char *buf, bool bigendian)
 	}
 }
 
-static uint32_t
-u_endian_read4(unsigned char *buf, bool bigendian)
+template <bool bigendian> static inline uint32_t
+u_endian_read4(const unsigned char *buf)
 {
 	if (bigendian) {
 		return ((uint32_t)(buf[0]) << 24) |
@@ -224,8 +250,8 @@ u_endian_read4(unsigned char *buf, bool bigendian)
 	}
 }
 
-static uint64_t
-u_endian_read5(unsigned char *buf, bool bigendian)
+template <bool bigendian> static inline uint64_t
+u_endian_read5(const unsigned char *buf)
 {
 	if (bigendian) {
 		return ((uint64_t)(buf[0]) << 32) |
@@ -242,8 +268,8 @@ u_endian_read5(unsigned char *buf, bool bigendian)
 	}
 }
 
-static uint64_t
-u_endian_read8(unsigned char *buf, bool bigendian)
+template <bool bigendian> static inline uint64_t
+u_endian_read8(const unsigned char *buf)
 {
 	if (bigendian) {
 		return ((uint64_t)(buf[0]) << 56) |
@@ -266,11 +292,36 @@ u_endian_read8(unsigned char *buf, bool bigendian)
 	}
 }
 
+static uint16_t
+u_endian_read2(const unsigned char *buf, bool bigendian)
+{
+	return bigendian ? u_endian_read2<true>(buf) : u_endian_read2<false>(buf);
+}
+
+static uint32_t
+u_endian_read4(const unsigned char *buf, bool bigendian)
+{
+	return bigendian ? u_endian_read4<true>(buf) : u_endian_read4<false>(buf);
+}
+
+static uint64_t
+u_endian_read5(const unsigned char *buf, bool bigendian)
+{
+	return bigendian ? u_endian_read5<true>(buf) : u_endian_read5<false>(buf);
+}
+
+static uint64_t
+u_endian_read8(const unsigned char *buf, bool bigendian)
+{
+	return bigendian ? u_endian_read8<true>(buf) : u_endian_read8<false>(buf);
+}
+
 void
 PTFFormat::cleanup(void) {
 	_len = 0;
 	_sessionrate = 0;
 	_version = 0;
+	_partial = false;
 	free(_ptfunxored);
 	_ptfunxored = NULL;
 	free (_product);
@@ -280,69 +331,90 @@ PTFFormat::cleanup(void) {
 	_midiregions.clear();
 	_tracks.clear();
 	_miditracks.clear();
+	_midichunks.clear();
+	_trackspans.clear();
+	_miditrackspans.clear();
+	_wavnames.clear();
+	_regionnames.clear();
+	_plugins.clear();
+	_iochannels.clear();
+	_routing.clear();
+	_plugins_done = _iochannels_done = _routing_done = false;
+	_compounds.clear();
+	_flat.clear();
+	_flatstate.clear();
 	free_all_blocks();
+	_blockhash.clear();
 }
 
-int64_t
-PTFFormat::foundat(unsigned char *haystack, uint64_t n, const char *needle) {
-	int64_t found = 0;
-	uint64_t i, j, needle_n;
-	needle_n = strlen(needle);
-
-	for (i = 0; i < n; i++) {
-		found = i;
-		for (j = 0; j < needle_n; j++) {
-			if (haystack[i+j] != needle[j]) {
-				found = -1;
-				break;
-			}
+/* Offset of the first occurrence of needle lying entirely within
+ * buf[from, to), or -1.  Short needles, which is all the parser uses,
+ * are found by scanning for their first byte with memchr; longer ones
+ * use Horspool skipping.
+ */
+static int64_t
+memsearch(const unsigned char *buf, uint64_t from, uint64_t to, const unsigned char *needle, uint32_t needlelen)
+{
+	const unsigned char *p, *last;
+	uint32_t i;
+
+	if (needlelen == 0)
+		return from;
+	if (to < from || to - from < needlelen)
+		return -1;
+
+	last = buf + to - needlelen;
+
+	if (needlelen < 16) {
+		for (p = buf + from; p <= last; p++) {
+			p = (const unsigned char *)memchr(p, needle[0], last - p + 1);
+			if (!p)
+				return -1;
+			if (memcmp(p + 1, needle + 1, needlelen - 1) == 0)
+				return p - buf;
 		}
-		if (found > 0)
-			return found;
+		return -1;
+	}
+
+	uint32_t skip[256];
+	for (i = 0; i < 256; i++)
+		skip[i] = needlelen;
+	for (i = 0; i < needlelen - 1; i++)
+		skip[needle[i]] = needlelen - 1 - i;
+
+	for (p = buf + from; p <= last; p += skip[p[needlelen - 1]]) {
+		if (p[needlelen - 1] == needle[needlelen - 1] &&
+				memcmp(p, needle, needlelen - 1) == 0)
+			return p - buf;
 	}
 	return -1;
 }
 
+int64_t
+PTFFormat::foundat(unsigned char *haystack, uint64_t n, const char *needle) {
+	uint64_t needle_n = strlen(needle);
+
+	/* A match at offset 0 is not reported */
+	return memsearch(haystack, 1, n + needle_n - 1, (const unsigned char *)needle, needle_n);
+}
+
 bool
 PTFFormat::jumpto(uint32_t *currpos, unsigned char *buf, const uint32_t maxoffset, const unsigned char *needle, const uint32_t needlelen) {
-	uint64_t i;
-	uint64_t k = *currpos;
-	while (k + needlelen < maxoffset) {
-		bool foundall = true;
-		for (i = 0; i < needlelen; i++) {
-			if (buf[k+i] != needle[i]) {
-				foundall = false;
-				break;
-			}
-		}
-		if (foundall) {
-			*currpos = k;
-			return true;
-		}
-		k++;
-	}
-	return false;
+	int64_t found;
+
+	/* Matches must end before the last byte below maxoffset */
+	if (maxoffset == 0)
+		return false;
+	found = memsearch(buf, *currpos, maxoffset - 1, needle, needlelen);
+	if (found < 0)
+		return false;
+	*currpos = found;
+	return true;
 }
 
 bool
-PTFFormat::jumpback(uint32_t *currpos, unsigned char *buf, const uint32_t maxoffset, const unsigned char *needle, const uint32_t needlelen) {
-	uint64_t i;
-	uint64_t k = *currpos;
-	while (k > 0 && k + needlelen < maxoffset) {
-		bool foundall = true;
-		for (i = 0; i < needlelen; i++) {
-			if (buf[k+i] != needle[i]) {
-				foundall = false;
-				break;
-			}
-		}
-		if (foundall) {
-			*currpos = k;
-			return true;
-		}
-		k--;
-	}
-	return false;
+PTFFormat::foundin(const char *haystack, uint32_t n, const char *needle, uint32_t needlelen) {
+	return memsearch((const unsigned char *)haystack, 0, n, (const unsigned char *)needle, needlelen) >= 0;
 }
 
 bool
@@ -355,48 +427,32 @@ PTFFormat::foundin(std::string const& haystack, std::string const& needle) {
 	}
 }
 
-/* Return values:	0            success
-			-1           error decrypting pt session
-*/
-int
-PTFFormat::unxor(std::string const& path) {
-	FILE *fp;
-	unsigned char xxor[256];
-	unsigned char ct;
+/* Decrypt n bytes of buf that start at file offset pos */
+static void
+decrypt(unsigned char *buf, uint64_t n, uint64_t pos, uint8_t xor_type, const unsigned char *xxor)
+{
 	uint64_t i;
-	uint8_t xor_type;
-	uint8_t xor_value;
-	uint8_t xor_delta;
-	uint16_t xor_len;
-
-	if (! (fp = ptf_open(path.c_str(), "rb"))) {
-		return -1;
-	}
-
-	fseek(fp, 0, SEEK_END);
-	_len = ftell(fp);
-	if (_len < 0x14) {
-		fclose(fp);
-		return -1;
-	}
 
-	if (! (_ptfunxored = (unsigned char*) malloc(_len * sizeof(unsigned char)))) {
-		/* Silently fail -- out of memory*/
-		fclose(fp);
-		_ptfunxored = 0;
-		return -1;
+	if (xor_type == 0x01) {
+		for (i = 0; i < n; i++)
+			buf[i] ^= xxor[(pos + i) & 0xff];
+	} else {
+		for (i = 0; i < n; i++)
+			buf[i] ^= xxor[((pos + i) >> 12) & 0xff];
 	}
+}
 
-	/* The first 20 bytes are always unencrypted */
-	fseek(fp, 0x00, SEEK_SET);
-	i = fread(_ptfunxored, 1, 0x14, fp);
-	if (i < 0x14) {
-		fclose(fp);
-		return -1;
-	}
+/* Generate the xor key from the first 20 bytes of a session,
+ * which are always unencrypted */
+bool
+PTFFormat::gen_xor_key(const unsigned char *header, uint8_t& xor_type, unsigned char *xxor) {
+	uint8_t xor_value;
+	uint8_t xor_delta;
+	uint16_t xor_len;
+	uint16_t i;
 
-	xor_type = _ptfunxored[0x12];
-	xor_value = _ptfunxored[0x13];
+	xor_type = header[0x12];
+	xor_value = header[0x13];
 	xor_len = 256;
 
 	// xor_type 0x01 = ProTools 5, 6, 7, 8 and 9
@@ -409,8 +465,7 @@ PTFFormat::unxor(std::string const& path) {
 		xor_delta = gen_xor_delta(xor_value, 11, true);
 		break;
 	default:
-		fclose(fp);
-		return -1;
+		return false;
 	}
 
 	/* Generate the xor_key */
@@ -418,186 +473,1292 @@ PTFFormat::unxor(std::string const& path) {
 		xxor[i] = (i * xor_delta) & 0xff;
 
 	/* hexdump(xxor, xor_len); */
-
-	/* Read file and decrypt rest of file */
-	i = 0x14;
-	fseek(fp, i, SEEK_SET);
-	while (fread(&ct, 1, 1, fp) != 0) {
-		uint8_t xor_index = (xor_type == 0x01) ? i & 0xff : (i >> 12) & 0xff;
-		_ptfunxored[i++] = ct ^ xxor[xor_index];
-	}
-	fclose(fp);
-	return 0;
+	return true;
 }
 
-/* Return values:	0            success
-			-1           error decrypting pt session
-			-2           error detecting pt session
-			-3           incompatible pt version
-			-4           error parsing pt session
-*/
 int
-PTFFormat::load(std::string const& ptf, int64_t targetsr) {
-	cleanup();
-	_path = ptf;
+PTFFormat::unxor_stream(FILE *in, FILE *out) {
+	unsigned char xxor[256];
+	unsigned char *buf;
+	uint8_t xor_type;
+	uint64_t pos;
+	size_t n;
+	int ret = 0;
 
-	if (unxor(_path))
+	if (! (buf = (unsigned char*) malloc(STREAM_CHUNK))) {
 		return -1;
+	}
 
-	if (parse_version())
+	n = fread(buf, 1, 0x14, in);
+	if (fwrite(buf, 1, n, out) != n) {
+		free(buf);
 		return -2;
-
-	if (_version < 5 || _version > 12)
-		return -3;
-
-	_targetrate = targetsr;
-
-	int err = 0;
-	if ((err = parse())) {
-		printf ("PARSE FAILED %d\n", err);
-		return -4;
+	}
+	if (n < 0x14 || !gen_xor_key(buf, xor_type, xxor)) {
+		free(buf);
+		return -1;
 	}
 
-	return 0;
+	pos = 0x14;
+	while ((n = fread(buf, 1, STREAM_CHUNK, in)) > 0) {
+		decrypt(buf, n, pos, xor_type, xxor);
+		if (fwrite(buf, 1, n, out) != n) {
+			ret = -2;
+			break;
+		}
+		pos += n;
+	}
+	if (ferror(in)) {
+		ret = -1;
+	}
+	free(buf);
+	return ret;
 }
 
-bool
-PTFFormat::parse_version() {
-	bool failed = true;
-	struct block_t b;
+PTFFormat::FileSource::FileSource(std::string const& path)
+	: _path (path)
+	, _fp (ptf_open(path.c_str(), "rb"))
+	, _pos (0)
+{
+}
 
-	if (_ptfunxored[0] != '\x03' && foundat(_ptfunxored, 0x100, BITCODE) != 1) {
-		return failed;
-	}
+PTFFormat::FileSource::~FileSource() {
+	if (_fp)
+		fclose(_fp);
+}
 
-	is_bigendian = !!_ptfunxored[0x11];
+int64_t
+PTFFormat::FileSource::size(void) {
+	long len;
 
-	if (!parse_block_at(0x1f, &b, NULL, 0)) {
-		_version = _ptfunxored[0x40];
-		if (_version == 0) {
-			_version = _ptfunxored[0x3d];
-		}
-		if (_version == 0) {
-			_version = _ptfunxored[0x3a] + 2;
-		}
-		if (_version != 0)
-			failed = false;
-		return failed;
-	} else {
-		if (b.content_type == 0x0003) {
-			// old
-			uint16_t skip = parsestring(b.offset + 3).size() + 8;
-			_version = u_endian_read4(&_ptfunxored[b.offset + 3 + skip], is_bigendian);
-			failed = false;
-		} else if (b.content_type == 0x2067) {
-			// new
-			_version = 2 + u_endian_read4(&_ptfunxored[b.offset + 20], is_bigendian);
-			failed = false;
-		}
-		return failed;
-	}
+	if (!_fp || fseek(_fp, 0, SEEK_END) || (len = ftell(_fp)) < 0)
+		return -1;
+	_pos = -1;
+	return len;
 }
 
-uint8_t
-PTFFormat::gen_xor_delta(uint8_t xor_value, uint8_t mul, bool negative) {
-	uint16_t i;
-	for (i = 0; i < 256; i++) {
-		if (((i * mul) & 0xff) == xor_value) {
-				return (negative) ? i * (-1) : i;
-		}
+int64_t
+PTFFormat::FileSource::read(uint64_t pos, void* buf, uint64_t n) {
+	size_t got;
+
+	if (!_fp)
+		return -1;
+	/* Sequential reads, the common case, do not seek */
+	if ((int64_t)pos != _pos && fseek(_fp, pos, SEEK_SET)) {
+		_pos = -1;
+		return -1;
 	}
-	// Should not occur
-	return 0;
+	got = fread(buf, 1, n, _fp);
+	_pos = pos + got;
+	if (got == 0 && ferror(_fp))
+		return -1;
+	return got;
 }
 
-void
-PTFFormat::setrates(void) {
-	_ratefactor = 1.f;
-	if (_sessionrate != 0) {
-		_ratefactor = (float)_targetrate / _sessionrate;
-	}
+int64_t
+PTFFormat::MemorySource::read(uint64_t pos, void* buf, uint64_t n) {
+	if (pos >= _len)
+		return 0;
+	n = std::min(n, _len - pos);
+	memcpy(buf, _data + pos, n);
+	return n;
 }
 
-bool
-PTFFormat::parse_block_at(uint32_t pos, struct block_t *block, struct block_t *parent, int level) {
-	struct block_t b;
-	int childjump = 0;
-	uint32_t i;
-	uint32_t max = _len;
+int64_t
+PTFFormat::FdSource::size(void) {
+	struct stat st;
 
-	if (_ptfunxored[pos] != ZMARK)
-		return false;
+	if (fstat(_fd, &st))
+		return -1;
+	return st.st_size;
+}
 
-	if (parent)
-		max = parent->block_size + parent->offset;
+int64_t
+PTFFormat::FdSource::read(uint64_t pos, void* buf, uint64_t n) {
+	ssize_t got;
 
-	b.zmark = ZMARK;
-	b.block_type = u_endian_read2(&_ptfunxored[pos+1], is_bigendian);
-	b.block_size = u_endian_read4(&_ptfunxored[pos+3], is_bigendian);
-	b.content_type = u_endian_read2(&_ptfunxored[pos+7], is_bigendian);
-	b.offset = pos + 7;
+	do {
+		got = pread(_fd, buf, n, pos);
+	} while (got < 0 && errno == EINTR);
+	return got;
+}
 
-	if (b.block_size + b.offset > max)
-		return false;
-	if (b.block_type & 0xff00)
-		return false;
+/* The block at index block is read into one buffer while read() copies
+ * out of the other */
+struct PTFFormat::ReadAheadSource::fetch_t {
+	ReadAheadSource* self;
+	unsigned char*   buf;
+	uint64_t         block;
+	int64_t          got;
+	pthread_t        thread;
+	bool             running;
+};
 
-	block->zmark = b.zmark;
-	block->block_type = b.block_type;
-	block->block_size = b.block_size;
-	block->content_type = b.content_type;
-	block->offset = b.offset;
-	block->child.clear();
+PTFFormat::ReadAheadSource::ReadAheadSource(Source& src, uint32_t blocksize)
+	: _src (src)
+	, _blocksize (blocksize ? (blocksize + 4095) & ~4095U : 0x100000)
+	, _size (-1)
+	, _fetch (NULL)
+	, _ahead (NULL)
+{
+	_fetch = new fetch_t;
+	_ahead = new fetch_t;
+	_fetch->self = _ahead->self = this;
+	_fetch->got = _ahead->got = -1;
+	_fetch->running = _ahead->running = false;
+	if (posix_memalign((void**)&_fetch->buf, 4096, _blocksize))
+		_fetch->buf = NULL;
+	if (posix_memalign((void**)&_ahead->buf, 4096, _blocksize))
+		_ahead->buf = NULL;
+}
 
-	for (i = 1; (i < block->block_size) && (pos + i + childjump < max); i += childjump ? childjump : 1) {
-		int p = pos + i;
-		struct block_t bchild;
-		childjump = 0;
-		if (parse_block_at(p, &bchild, block, level+1)) {
-			block->child.push_back(bchild);
-			childjump = bchild.block_size + 7;
-		}
-	}
-	return true;
+PTFFormat::ReadAheadSource::~ReadAheadSource() {
+	finish(_ahead);
+	free(_fetch->buf);
+	free(_ahead->buf);
+	delete _fetch;
+	delete _ahead;
 }
 
-void
-PTFFormat::dump_block(struct block_t& b, int level)
-{
-	int i;
+int64_t
+PTFFormat::ReadAheadSource::size(void) {
+	if (_size < 0)
+		_size = _src.size();
+	return _size;
+}
 
-	for (i = 0; i < level; i++) {
-		printf("    ");
-	}
-	printf("%s(0x%04x)\n", get_content_description(b.content_type).c_str(), b.content_type);
-	hexdump(&_ptfunxored[b.offset], b.block_size, level);
+void*
+PTFFormat::ReadAheadSource::fetch_job(void* arg) {
+	fetch_t* f = (fetch_t*) arg;
+	f->got = f->self->fill(f->buf, f->block);
+	return NULL;
+}
 
-	for (vector<PTFFormat::block_t>::iterator c = b.child.begin();
-			c != b.child.end(); ++c) {
-		dump_block(*c, level + 1);
+/* Read all of block into buf, short only at the end of the source */
+int64_t
+PTFFormat::ReadAheadSource::fill(unsigned char* buf, uint64_t block) {
+	uint64_t pos = block * _blocksize;
+	int64_t got = 0, n;
+
+	while (got < (int64_t)_blocksize) {
+		n = _src.read(pos + got, buf + got, _blocksize - got);
+		if (n < 0)
+			return -1;
+		if (n == 0)
+			break;
+		got += n;
 	}
+	return got;
 }
 
 void
-PTFFormat::free_block(struct block_t& b)
+PTFFormat::ReadAheadSource::start(fetch_t* f, uint64_t block) {
+	f->block = block;
+	f->got = -1;
+	f->running = !pthread_create(&f->thread, NULL, fetch_job, f);
+	if (!f->running)
+		f->got = fill(f->buf, block);
+}
+
+void
+PTFFormat::ReadAheadSource::finish(fetch_t* f) {
+	if (f->running) {
+		pthread_join(f->thread, NULL);
+		f->running = false;
+	}
+}
+
+int64_t
+PTFFormat::ReadAheadSource::read(uint64_t pos, void* buf, uint64_t n) {
+	uint64_t block = pos / _blocksize;
+	uint64_t off = pos % _blocksize;
+
+	if (!_fetch->buf || !_ahead->buf)
+		return _src.read(pos, buf, n);
+
+	if (_fetch->got < 0 || _fetch->block != block) {
+		finish(_ahead);
+		if (_ahead->got >= 0 && _ahead->block == block) {
+			std::swap(_fetch, _ahead);
+		} else {
+			_fetch->block = block;
+			_fetch->got = fill(_fetch->buf, block);
+			if (_fetch->got < 0)
+				return -1;
+		}
+		/* Reading on, fetch the next block while this one is used */
+		if (_fetch->got == (int64_t)_blocksize &&
+				(_size < 0 || (int64_t)((block + 1) * _blocksize) < _size)) {
+			start(_ahead, block + 1);
+		}
+	}
+
+	if ((int64_t)off >= _fetch->got)
+		return 0;
+	n = std::min(n, (uint64_t)_fetch->got - off);
+	memcpy(buf, _fetch->buf + off, n);
+	return n;
+}
+
+/* Whether an archive member looks like the session to load, rather
+ * than media, a session backup or a macOS resource fork */
+static bool
+archive_session(std::string const& name)
+{
+	std::string::size_type slash = name.rfind('/');
+	std::string base = name.substr(slash == std::string::npos ? 0 : slash + 1);
+	std::string::size_type dot = base.rfind('.');
+	const char* ext;
+
+	if (dot == std::string::npos || base.compare(0, 2, "._") == 0 ||
+			name.find("__MACOSX/") != std::string::npos ||
+			name.find("Session File Backups/") != std::string::npos) {
+		return false;
+	}
+	ext = base.c_str() + dot + 1;
+	return !strcasecmp(ext, "ptx") || !strcasecmp(ext, "ptf") ||
+		!strcasecmp(ext, "pts") || !strcasecmp(ext, "pt5");
+}
+
+/* A NUL padded tar header field */
+static std::string
+tar_string(const unsigned char* f, int n)
+{
+	int len = 0;
+
+	while (len < n && f[len])
+		len++;
+	return std::string((const char*) f, len);
+}
+
+/* An octal tar header field, or base-256 if the top bit is set */
+static uint64_t
+tar_number(const unsigned char* f, int n)
+{
+	uint64_t v = 0;
+	int i = 0;
+
+	if (f[0] & 0x80) {
+		for (i = 1; i < n; i++)
+			v = (v << 8) | f[i];
+		return v;
+	}
+	while (i < n && f[i] == ' ')
+		i++;
+	for (; i < n && f[i] >= '0' && f[i] <= '7'; i++)
+		v = (v << 3) | (f[i] - '0');
+	return v;
+}
+
+/* The path= record of pax extended header data, "" if none */
+static std::string
+pax_path(std::string const& d)
+{
+	std::string::size_type i = 0, sp, len;
+
+	while (i < d.size()) {
+		len = strtoul(d.c_str() + i, NULL, 10);
+		sp = d.find(' ', i);
+		if (len == 0 || sp == std::string::npos || sp + 2 > i + len || i + len > d.size())
+			break;
+		if (d.compare(sp + 1, 5, "path=") == 0)
+			return d.substr(sp + 6, i + len - sp - 7);
+		i += len;
+	}
+	return "";
+}
+
+/* The decompressor of a deflated zip member or a .tar.gz, reading on
+ * from where the last read stopped and starting over for reads behind
+ * it */
+struct PTFFormat::ArchiveSource::inflate_t {
+#ifdef HAVE_ZLIB
+	z_stream      zs;
+	bool          ready;	// zs is initialized
+#endif
+	uint64_t      in;	// next byte of the stream in src to read
+	uint64_t      out;	// bytes of the stream inflated so far
+	bool          end;
+	unsigned char buf[0x10000];
+	unsigned char skip[0x10000];
+};
+
+PTFFormat::ArchiveSource::ArchiveSource(Source& src, std::string const& member)
+	: _src (src)
+	, _member (member)
+	, _archive (false)
+	, _codec (0)
+	, _start (0)
+	, _length (0)
+	, _offset (0)
+	, _size (-1)
+	, _z (NULL)
+{
+	unsigned char magic[4];
+	int64_t len = src.size();
+
+	if (len < 4)
+		return;
+	_length = len;
+	if (!read_all(0, magic, 4))
+		return;
+
+	if (!memcmp(magic, "PK\x03\x04", 4) || !memcmp(magic, "PK\x05\x06", 4)) {
+		_archive = true;
+		find_zip(member);
+	} else if (magic[0] == 0x1f && magic[1] == 0x8b) {
+		_archive = true;
+		_codec = 2;
+		find_tar(member);
+	} else {
+		find_tar(member);
+	}
+}
+
+PTFFormat::ArchiveSource::~ArchiveSource() {
+#ifdef HAVE_ZLIB
+	if (_z && _z->ready)
+		inflateEnd(&_z->zs);
+#endif
+	delete _z;
+}
+
+/* Look the member up in the central directory at the end of a zip */
+bool
+PTFFormat::ArchiveSource::find_zip(std::string const& member) {
+	std::vector<unsigned char> tail, cd;
+	uint64_t from = _length > 0xffff + 22 ? _length - (0xffff + 22) : 0;
+	uint64_t i, data;
+	uint32_t cdsize, cdoff;
+	unsigned char lh[30];
+	int64_t eocd = -1;
+
+	tail.resize(_length - from);
+	if (!read_all(from, &tail[0], tail.size()))
+		return false;
+	for (int64_t j = (int64_t)tail.size() - 22; j >= 0; j--) {
+		if (!memcmp(&tail[j], "PK\x05\x06", 4)) {
+			eocd = j;
+			break;
+		}
+	}
+	if (eocd < 0)
+		return false;
+	cdsize = u_endian_read4<false>(&tail[eocd + 12]);
+	cdoff = u_endian_read4<false>(&tail[eocd + 16]);
+	if ((uint64_t)cdoff + cdsize > _length || cdsize == 0)
+		return false;
+	cd.resize(cdsize);
+	if (!read_all(cdoff, &cd[0], cdsize))
+		return false;
+
+	for (i = 0; i + 46 <= cd.size(); ) {
+		const unsigned char* e = &cd[i];
+		uint16_t flags = u_endian_read2<false>(e + 8);
+		uint16_t method = u_endian_read2<false>(e + 10);
+		uint32_t csize = u_endian_read4<false>(e + 20);
+		uint32_t usize = u_endian_read4<false>(e + 24);
+		uint16_t nlen = u_endian_read2<false>(e + 28);
+		uint32_t local = u_endian_read4<false>(e + 42);
+
+		if (memcmp(e, "PK\x01\x02", 4) || i + 46 + nlen > cd.size())
+			break;
+		std::string name ((const char*) e + 46, nlen);
+		i += 46 + nlen + u_endian_read2<false>(e + 30) + u_endian_read2<false>(e + 32);
+		if (member.empty() ? !archive_session(name) : name != member)
+			continue;
+
+		_member = name;
+		/* Encrypted and zip64 members are not read */
+		if ((flags & 1) || csize == 0xffffffff || usize == 0xffffffff)
+			return false;
+		if (!read_all(local, lh, 30) || memcmp(lh, "PK\x03\x04", 4))
+			return false;
+		data = (uint64_t)local + 30 + u_endian_read2<false>(lh + 26) + u_endian_read2<false>(lh + 28);
+		if (data + csize > _length)
+			return false;
+		if (method == 0 && csize == usize) {
+			_codec = 0;
+#ifdef HAVE_ZLIB
+		} else if (method == 8) {
+			_codec = 1;
+#endif
+		} else {
+			return false;
+		}
+		_start = data;
+		_length = csize;
+		_offset = 0;
+		_size = usize;
+		return true;
+	}
+	return false;
+}
+
+/* Walk the headers of a tar stream up to the member, only as far into
+ * a .tar.gz as that needs */
+bool
+PTFFormat::ArchiveSource::find_tar(std::string const& member) {
+	unsigned char h[512];
+	std::string name, longname;
+	uint64_t pos = 0, size, data;
+	uint32_t sum, i;
+
+	while (read_all(pos, h, 512)) {
+		if (h[0] == 0)
+			break;		// the end of the archive
+		for (sum = 0, i = 0; i < 512; i++)
+			sum += (i >= 148 && i < 156) ? ' ' : h[i];
+		if (sum != tar_number(h + 148, 8))
+			break;
+		_archive = true;
+
+		size = tar_number(h + 124, 12);
+		data = pos + 512;
+		if (!longname.empty()) {
+			name = longname;
+			longname.clear();
+		} else if (!memcmp(h + 257, "ustar", 5) && h[345]) {
+			name = tar_string(h + 345, 155) + "/" + tar_string(h, 100);
+		} else {
+			name = tar_string(h, 100);
+		}
+		if (name.compare(0, 2, "./") == 0)
+			name.erase(0, 2);
+
+		if ((h[156] == 'L' || h[156] == 'x') && size < 0x10000) {
+			/* The name of the next member, in full */
+			std::string d (size, '\0');
+			if (size && !read_all(data, &d[0], size))
+				break;
+			longname = h[156] == 'L' ? tar_string((const unsigned char*) d.c_str(), size) : pax_path(d);
+		} else if ((h[156] == '0' || h[156] == '\0') &&
+				(member.empty() ? archive_session(name) : name == member)) {
+			_member = name;
+			_offset = data;
+			_size = size;
+			return true;
+		}
+		pos = data + ((size + 511) & ~(uint64_t)511);
+	}
+	return false;
+}
+
+int64_t
+PTFFormat::ArchiveSource::read(uint64_t pos, void* buf, uint64_t n) {
+	if (_size < 0)
+		return -1;
+	if (pos >= (uint64_t)_size)
+		return 0;
+	return read_stream(_offset + pos, buf, std::min(n, (uint64_t)_size - pos));
+}
+
+bool
+PTFFormat::ArchiveSource::read_all(uint64_t pos, void* buf, uint64_t n) {
+	unsigned char* p = (unsigned char*) buf;
+	int64_t got;
+
+	while (n) {
+		if ((got = read_stream(pos, p, n)) <= 0)
+			return false;
+		pos += got;
+		p += got;
+		n -= got;
+	}
+	return true;
+}
+
+/* Read the stream the member is in, inflated if it is compressed */
+int64_t
+PTFFormat::ArchiveSource::read_stream(uint64_t pos, void* buf, uint64_t n) {
+	if (_codec == 0) {
+		if (pos >= _length)
+			return 0;
+		return _src.read(_start + pos, buf, std::min(n, _length - pos));
+	}
+#ifdef HAVE_ZLIB
+	int64_t got;
+
+	if (!_z) {
+		_z = new inflate_t;
+		_z->ready = false;
+	}
+	if (!_z->ready || pos < _z->out) {
+		if (_z->ready)
+			inflateEnd(&_z->zs);
+		memset(&_z->zs, 0, sizeof(_z->zs));
+		_z->ready = inflateInit2(&_z->zs, _codec == 1 ? -MAX_WBITS : 16 + MAX_WBITS) == Z_OK;
+		if (!_z->ready)
+			return -1;
+		_z->in = _z->out = 0;
+		_z->end = false;
+	}
+	/* Inflate up to pos into scratch, then straight into buf */
+	while (_z->out < pos) {
+		if ((got = inflate_some(_z->skip, std::min(pos - _z->out, (uint64_t)sizeof(_z->skip)))) <= 0)
+			return got;
+	}
+	return inflate_some(buf, n);
+#else
+	(void) buf;
+	return -1;
+#endif
+}
+
+/* Inflate at most n bytes of the stream into buf, at least one unless
+ * it ended */
+int64_t
+PTFFormat::ArchiveSource::inflate_some(void* buf, uint64_t n) {
+#ifdef HAVE_ZLIB
+	z_stream& zs = _z->zs;
+	uInt want = std::min(n, (uint64_t)0x40000000);
+	int64_t got;
+	int ret;
+
+	zs.next_out = (Bytef*) buf;
+	zs.avail_out = want;
+	while (zs.avail_out == want && !_z->end) {
+		if (zs.avail_in == 0) {
+			got = _src.read(_start + _z->in, _z->buf, std::min((uint64_t)sizeof(_z->buf), _length - _z->in));
+			if (got <= 0)
+				return -1;	// truncated
+			_z->in += got;
+			zs.next_in = _z->buf;
+			zs.avail_in = got;
+		}
+		ret = inflate(&zs, Z_NO_FLUSH);
+		if (ret == Z_STREAM_END)
+			_z->end = true;
+		else if (ret != Z_OK)
+			return -1;
+	}
+	_z->out += want - zs.avail_out;
+	return want - zs.avail_out;
+#else
+	(void) buf;
+	(void) n;
+	return -1;
+#endif
+}
+
+/* Size the session of src, allocate _ptfunxored and read the
+ * unencrypted header into it, then generate the key for the rest */
+bool
+PTFFormat::unxor_open(Source& src, uint8_t& xor_type, unsigned char *xxor) {
+	int64_t len = src.size();
+
+	if (len < 0x14) {
+		return false;
+	}
+	_len = len;
+
+	if (! (_ptfunxored = (unsigned char*) malloc(_len * sizeof(unsigned char)))) {
+		/* Silently fail -- out of memory*/
+		_ptfunxored = 0;
+		return false;
+	}
+
+	/* The first 20 bytes are always unencrypted */
+	if (src.read(0, _ptfunxored, 0x14) < 0x14) {
+		return false;
+	}
+
+	return gen_xor_key(_ptfunxored, xor_type, xxor);
+}
+
+int
+PTFFormat::unxor(std::string const& path) {
+	FileSource src (path);
+	return unxor(src);
+}
+
+int
+PTFFormat::unxor(Source& src) {
+	unsigned char xxor[256];
+	uint64_t i;
+	uint8_t xor_type;
+
+	if (!unxor_open(src, xor_type, xxor)) {
+		return -1;
+	}
+
+	/* Read file and decrypt rest of file */
+	i = 0x14;
+	while (i < _len) {
+		int64_t n = src.read(i, &_ptfunxored[i], std::min(_len - i, (uint64_t)DECRYPT_CHUNK));
+		if (n <= 0)
+			break;
+		decrypt(&_ptfunxored[i], n, i, xor_type, xxor);
+		i += n;
+		if (!progress(PhaseDecrypt, i, _len)) {
+			return -1;
+		}
+	}
+	/* A read error or a source shorter than its size() */
+	if (i < _len) {
+		return -1;
+	}
+	return 0;
+}
+
+/* State of a pipelined load, see set_pipelined() */
+struct PTFFormat::pipe_t {
+	Source*         src;
+	pthread_t       thread;
+	bool            threaded;
+	pthread_mutex_t lock;
+	pthread_cond_t  more;
+	uint64_t        decrypted;	// bytes ready, the high-water mark
+	bool            done;		// decrypted will not grow any more
+	uint8_t         xor_type;
+	unsigned char   xxor[256];
+};
+
+/* Read and decrypt everything after the header, publishing how far
+ * it got after every chunk */
+void*
+PTFFormat::decrypt_job(void* arg) {
+	PTFFormat* self = (PTFFormat*) arg;
+	pipe_t* p = self->_pipe;
+	uint64_t i = 0x14;
+
+	while (i < self->_len && !self->_cancel) {
+		int64_t n = p->src->read(i, &self->_ptfunxored[i], std::min(self->_len - i, (uint64_t)DECRYPT_CHUNK));
+		if (n <= 0)
+			break;		// short of _len, see unxor_finish()
+		decrypt(&self->_ptfunxored[i], n, i, p->xor_type, p->xxor);
+		i += n;
+		pthread_mutex_lock(&p->lock);
+		p->decrypted = i;
+		pthread_cond_broadcast(&p->more);
+		pthread_mutex_unlock(&p->lock);
+	}
+	pthread_mutex_lock(&p->lock);
+	p->done = true;
+	pthread_cond_broadcast(&p->more);
+	pthread_mutex_unlock(&p->lock);
+	return NULL;
+}
+
+/* As unxor(), but only the header is ready on return, the rest is
+ * decrypted on a thread of its own, see wait_decrypted() */
+int
+PTFFormat::unxor_start(Source& src) {
+	pipe_t* p = new pipe_t;
+
+	if (!unxor_open(src, p->xor_type, p->xxor)) {
+		delete p;
+		return -1;
+	}
+	p->src = &src;
+	p->decrypted = 0x14;
+	p->done = false;
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->more, NULL);
+	_pipe = p;
+
+	p->threaded = !pthread_create(&p->thread, NULL, decrypt_job, this);
+	if (!p->threaded) {
+		decrypt_job(this);
+	}
+	return 0;
+}
+
+/* Wait until the first end bytes are decrypted or decryption stopped
+ * short of them, returns how many are */
+uint64_t
+PTFFormat::wait_decrypted(uint64_t end) {
+	uint64_t have;
+
+	if (!_pipe)
+		return _len;
+
+	pthread_mutex_lock(&_pipe->lock);
+	while (_pipe->decrypted < end && !_pipe->done) {
+		pthread_cond_wait(&_pipe->more, &_pipe->lock);
+	}
+	have = _pipe->decrypted;
+	pthread_mutex_unlock(&_pipe->lock);
+	return have;
+}
+
+/* End a pipelined decryption, false if it did not reach the end */
+bool
+PTFFormat::unxor_finish(void) {
+	bool complete;
+
+	if (!_pipe)
+		return true;
+
+	if (_pipe->threaded)
+		pthread_join(_pipe->thread, NULL);
+	complete = _pipe->decrypted == _len;
+	pthread_cond_destroy(&_pipe->more);
+	pthread_mutex_destroy(&_pipe->lock);
+	delete _pipe;
+	_pipe = NULL;
+	return complete;
+}
+
+/* Return values:	0            success
+			-1           error decrypting pt session
+			-2           error detecting pt session
+			-3           incompatible pt version
+			-4           error parsing pt session
+*/
+int
+PTFFormat::load(std::string const& ptf, int64_t targetsr) {
+	_cancel = false;
+	return load_session(ptf, targetsr);
+}
+
+int
+PTFFormat::load(Source& src, int64_t targetsr) {
+	_cancel = false;
+	return load_source(src, src.name(), targetsr);
+}
+
+int
+PTFFormat::load_blocks(std::string const& ptf) {
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	_start_ms = (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+	_cancel = false;
+
+	cleanup();
+	_path = ptf;
+
+	if (unxor(_path))
+		return _cancel ? -5 : -1;
+
+	if (parse_version())
+		return -2;
+
+	parseblocks();
+	return _cancel ? -5 : 0;
+}
+
+int
+PTFFormat::load_session(std::string const& ptf, int64_t targetsr) {
+	FileSource src (ptf);
+	return load_source(src, ptf, targetsr);
+}
+
+int
+PTFFormat::load_source(Source& src, std::string const& ptf, int64_t targetsr) {
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	_start_ms = (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+
+	cleanup();
+	_path = ptf;
+	_decrypted = true;
+
+	if (_pipelined ? unxor_start(src) : unxor(src))
+		return _cancel ? -5 : -1;
+
+	/* A pipelined load learns whether all of the session could be read
+	 * and decrypted only once it is done with it */
+	if (parse_version()) {
+		if (!unxor_finish())
+			return _cancel ? -5 : -1;
+		return -2;
+	}
+
+	if (_version < 5 || _version > 12) {
+		unxor_finish();
+		return -3;
+	}
+
+	_targetrate = targetsr;
+
+	int err = parse();
+	if (!unxor_finish() || !_decrypted) {
+		return _cancel ? -5 : -1;
+	}
+	if (err) {
+		if (_cancel)
+			return -5;
+		printf ("PARSE FAILED %d\n", err);
+		return -4;
+	}
+
+	return 0;
+}
+
+bool
+PTFFormat::out_of_time(void) {
+	struct timeval tv;
+
+	if (!_budget_ms)
+		return false;
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000 > _start_ms + _budget_ms;
+}
+
+/* Cancellation point, also cancels when out of time unless that can
+ * be handled by returning a partial result */
+bool
+PTFFormat::progress(phase_t phase, uint64_t done, uint64_t total) {
+	if (_progress && !_progress->progress(phase, done, total))
+		_cancel = true;
+	if (phase < PhaseMidi && out_of_time())
+		_cancel = true;
+	return !_cancel;
+}
+
+struct PTFFormat::async_t {
+	pthread_t   thread;
+	std::string path;
+	int64_t     targetsr;
+	int         result;
+};
+
+void*
+PTFFormat::async_load(void* arg) {
+	PTFFormat* self = (PTFFormat*) arg;
+	self->_async->result = self->load_session(self->_async->path, self->_async->targetsr);
+	return NULL;
+}
+
+int
+PTFFormat::load_async(std::string const& ptf, int64_t targetsr) {
+	if (_async)
+		return -1;
+
+	_async = new async_t;
+	_async->path = ptf;
+	_async->targetsr = targetsr;
+	_async->result = -1;
+	_cancel = false;
+
+	if (pthread_create(&_async->thread, NULL, async_load, this)) {
+		delete _async;
+		_async = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+int
+PTFFormat::wait(void) {
+	int result;
+
+	if (!_async)
+		return -1;
+
+	pthread_join(_async->thread, NULL);
+	result = _async->result;
+	delete _async;
+	_async = NULL;
+	return result;
+}
+
+void
+PTFFormat::hash_all_blocks(void) {
+	/* Only computed on demand, so that plain load() does not pay for them */
+	if (_blockhash.size() != blocks.size()) {
+		_blockhash.clear();
+		for (vector<PTFFormat::block_t>::iterator b = blocks.begin();
+				b != blocks.end(); ++b) {
+			_blockhash.push_back(hash_block(*b));
+		}
+	}
+}
+
+void
+PTFFormat::blockhashes(std::vector<std::pair<uint16_t, uint64_t> >& out) {
+	uint32_t i;
+
+	hash_all_blocks();
+	out.clear();
+	for (i = 0; i < blocks.size(); i++) {
+		out.push_back(std::make_pair(blocks[i].content_type, _blockhash[i]));
+	}
+}
+
+int
+PTFFormat::load(std::string const& ptf, int64_t targetsr, Visitor& v, bool keep) {
+	int err;
+
+	_visitor = &v;
+	_keep_events = keep;
+	err = load(ptf, targetsr);
+	_visitor = NULL;
+	_keep_events = true;
+
+	if (!keep) {
+		release();
+	}
+	return err;
+}
+
+/* Free the results, block tree and session data of the last load() */
+void
+PTFFormat::release(void) {
+	std::vector<wav_t>().swap(_audiofiles);
+	std::vector<region_t>().swap(_regions);
+	std::vector<region_t>().swap(_midiregions);
+	std::vector<track_t>().swap(_tracks);
+	std::vector<track_t>().swap(_miditracks);
+	std::vector<mchunk>().swap(_midichunks);
+	std::vector<compound_t>().swap(_compounds);
+	std::vector<std::vector<compound_element_t> >().swap(_flat);
+	std::vector<uint8_t>().swap(_flatstate);
+	free_all_blocks();
+	_blockhash.clear();
+	free(_ptfunxored);
+	_ptfunxored = NULL;
+	_len = 0;
+}
+
+int
+PTFFormat::load(std::string const& ptf, int64_t targetsr, SnapshotRef& out) {
+	int err;
+
+	out = SnapshotRef();
+	err = load(ptf, targetsr);
+	if (err) {
+		return err;
+	}
+
+	Snapshot* s = new Snapshot();
+	s->_path = _path;
+	s->_version = _version;
+	s->_sessionrate = _sessionrate;
+	s->_targetrate = _targetrate;
+	s->_partial = _partial;
+	s->_audiofiles.swap(_audiofiles);
+	s->_regions.swap(_regions);
+	s->_midiregions.swap(_midiregions);
+	s->_tracks.swap(_tracks);
+	s->_miditracks.swap(_miditracks);
+	s->_compounds.swap(_compounds);
+	release();
+
+	out = SnapshotRef(s);
+	return 0;
+}
+
+PTFFormat::SnapshotRef
+PTFFormat::snapshot(void) const {
+	if (!_ptfunxored) {
+		return SnapshotRef();
+	}
+
+	Snapshot* s = new Snapshot();
+	s->_path = _path;
+	s->_version = _version;
+	s->_sessionrate = _sessionrate;
+	s->_targetrate = _targetrate;
+	s->_partial = _partial;
+	s->_audiofiles = _audiofiles;
+	s->_regions = _regions;
+	s->_midiregions = _midiregions;
+	s->_tracks = _tracks;
+	s->_miditracks = _miditracks;
+	s->_compounds = _compounds;
+	return SnapshotRef(s);
+}
+
+/* The count is only touched with atomic builtins, which are full
+ * barriers, so the last handle sees every write to the snapshot */
+PTFFormat::SnapshotRef::SnapshotRef(SnapshotRef const& other)
+	: _s (other._s)
+{
+	if (_s) {
+		__sync_add_and_fetch(&_s->_refs, 1);
+	}
+}
+
+PTFFormat::SnapshotRef::~SnapshotRef() {
+	if (_s && __sync_sub_and_fetch(&_s->_refs, 1) == 0) {
+		delete _s;
+	}
+}
+
+PTFFormat::SnapshotRef&
+PTFFormat::SnapshotRef::operator=(SnapshotRef const& other) {
+	Snapshot* old = _s;
+
+	if (other._s) {
+		__sync_add_and_fetch(&other._s->_refs, 1);
+	}
+	_s = other._s;
+	if (old && __sync_sub_and_fetch(&old->_refs, 1) == 0) {
+		delete old;
+	}
+	return *this;
+}
+
+const PTFFormat::track_t*
+PTFFormat::Snapshot::find_track(uint16_t index) const {
+	std::vector<track_t>::const_iterator found =
+		std::find(_tracks.begin(), _tracks.end(), track_t (index));
+	return found != _tracks.end() ? &*found : NULL;
+}
+
+const PTFFormat::region_t*
+PTFFormat::Snapshot::find_region(uint16_t index) const {
+	std::vector<region_t>::const_iterator found =
+		std::find(_regions.begin(), _regions.end(), region_t (index));
+	return found != _regions.end() ? &*found : NULL;
+}
+
+const PTFFormat::track_t*
+PTFFormat::Snapshot::find_miditrack(uint16_t index) const {
+	std::vector<track_t>::const_iterator found =
+		std::find(_miditracks.begin(), _miditracks.end(), track_t (index));
+	return found != _miditracks.end() ? &*found : NULL;
+}
+
+const PTFFormat::region_t*
+PTFFormat::Snapshot::find_midiregion(uint16_t index) const {
+	std::vector<region_t>::const_iterator found =
+		std::find(_midiregions.begin(), _midiregions.end(), region_t (index));
+	return found != _midiregions.end() ? &*found : NULL;
+}
+
+const PTFFormat::wav_t*
+PTFFormat::Snapshot::find_wav(uint16_t index) const {
+	std::vector<wav_t>::const_iterator found =
+		std::find(_audiofiles.begin(), _audiofiles.end(), wav_t (index));
+	return found != _audiofiles.end() ? &*found : NULL;
+}
+
+int
+PTFFormat::reload(std::string const& ptf, int64_t targetsr) {
+	prev_session_t prev;
+	struct timeval tv;
+
+	if (!_ptfunxored || blocks.empty())
+		return load(ptf, targetsr);
+
+	_cancel = false;
+	gettimeofday(&tv, NULL);
+	_start_ms = (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+
+	hash_all_blocks();
+
+	prev.blocks.swap(blocks);
+	prev.blockhash.swap(_blockhash);
+	prev.audiofiles.swap(_audiofiles);
+	prev.regions.swap(_regions);
+	prev.midichunks.swap(_midichunks);
+	prev.sessionrate = _sessionrate;
+	prev.targetrate = _targetrate;
+	prev.version = _version;
+	prev.bigendian = is_bigendian;
+
+	cleanup();
+	_path = ptf;
+
+	if (unxor(_path))
+		return _cancel ? -5 : -1;
+
+	if (parse_version())
+		return -2;
+
+	if (_version < 5 || _version > 12)
+		return -3;
+
+	_targetrate = targetsr;
+
+	if (_version == prev.version && is_bigendian == prev.bigendian) {
+		_prev = &prev;
+	}
+
+	int err = parse();
+	_prev = NULL;
+
+	if (err) {
+		if (_cancel)
+			return -5;
+		printf ("PARSE FAILED %d\n", err);
+		return -4;
+	}
+
+	return 0;
+}
+
+bool
+PTFFormat::parse_version() {
+	bool failed = true;
+	struct block_t b;
+	/* foundat() reads a needle's length past the bytes it searches */
+	uint64_t probe = 0x100 + strlen(BITCODE) - 1;
+	uint64_t need = std::min(_len, probe);
+
+	/* A pipelined load may still be decrypting what is looked at here */
+	if (wait_decrypted(need) < need) {
+		return failed;
+	}
+
+	if (_ptfunxored[0] != '\x03' && (need < probe || foundat(_ptfunxored, 0x100, BITCODE) != 1)) {
+		return failed;
+	}
+
+	is_bigendian = !!_ptfunxored[0x11];
+
+	if (_ptfunxored[0x1f] == ZMARK) {
+		need = std::min(_len, 0x26 + (uint64_t)u_endian_read4(&_ptfunxored[0x22], is_bigendian));
+		if (wait_decrypted(need) < need) {
+			return failed;
+		}
+	}
+
+	if (!parse_block_at(0x1f, &b, NULL, 0)) {
+		_version = _ptfunxored[0x40];
+		if (_version == 0) {
+			_version = _ptfunxored[0x3d];
+		}
+		if (_version == 0) {
+			_version = _ptfunxored[0x3a] + 2;
+		}
+		if (_version != 0)
+			failed = false;
+		return failed;
+	} else {
+		if (b.content_type == 0x0003) {
+			// old
+			uint16_t skip = parsestring(b.offset + 3).size() + 8;
+			_version = u_endian_read4(&_ptfunxored[b.offset + 3 + skip], is_bigendian);
+			failed = false;
+		} else if (b.content_type == 0x2067) {
+			// new
+			_version = 2 + u_endian_read4(&_ptfunxored[b.offset + 20], is_bigendian);
+			failed = false;
+		}
+		return failed;
+	}
+}
+
+uint8_t
+PTFFormat::gen_xor_delta(uint8_t xor_value, uint8_t mul, bool negative) {
+	uint16_t i;
+	for (i = 0; i < 256; i++) {
+		if (((i * mul) & 0xff) == xor_value) {
+				return (negative) ? i * (-1) : i;
+		}
+	}
+	// Should not occur
+	return 0;
+}
+
+void
+PTFFormat::setrates(void) {
+	_ratefactor = 1.f;
+	if (_targetrate == 0) {
+		/* Keep native session samples */
+		_targetrate = _sessionrate;
+	} else if (_sessionrate != 0) {
+		_ratefactor = (float)_targetrate / _sessionrate;
+	}
+}
+
+template <bool bigendian> bool
+PTFFormat::parse_block_header(uint32_t pos, struct block_t *block, uint32_t max) {
+	struct block_t b;
+
+	if (_ptfunxored[pos] != ZMARK)
+		return false;
+
+	b.zmark = ZMARK;
+	b.block_type = u_endian_read2<bigendian>(&_ptfunxored[pos+1]);
+	b.block_size = u_endian_read4<bigendian>(&_ptfunxored[pos+3]);
+	b.content_type = u_endian_read2<bigendian>(&_ptfunxored[pos+7]);
+	b.offset = pos + 7;
+
+	if (b.block_size + b.offset > max)
+		return false;
+	if (b.block_type & 0xff00)
+		return false;
+
+	block->zmark = b.zmark;
+	block->block_type = b.block_type;
+	block->block_size = b.block_size;
+	block->content_type = b.content_type;
+	block->offset = b.offset;
+	block->child.clear();
+	return true;
+}
+
+template <bool bigendian> void
+PTFFormat::parse_block_children(struct block_t *block, uint32_t max, int level) {
+	int childjump = 0;
+	uint32_t i;
+	uint32_t pos = block->offset - 7;
+	uint32_t end = block->offset + block->block_size;
+
+	/* Find all direct children before descending into any of them, so
+	 * that growing the child vector never copies populated subtrees */
+	for (i = 1; (i < block->block_size) && (pos + i + childjump < max); i += childjump ? childjump : 1) {
+		int p = pos + i;
+		struct block_t bchild;
+		childjump = 0;
+		if (parse_block_header<bigendian>(p, &bchild, end)) {
+			block->child.push_back(bchild);
+			childjump = bchild.block_size + 7;
+		}
+	}
+
+	for (vector<PTFFormat::block_t>::iterator c = block->child.begin();
+			c != block->child.end(); ++c) {
+		parse_block_children<bigendian>(&*c, end, level + 1);
+	}
+}
+
+template <bool bigendian> bool
+PTFFormat::parse_block_at(uint32_t pos, struct block_t *block, struct block_t *parent, int level) {
+	uint32_t max = _len;
+
+	if (parent)
+		max = parent->block_size + parent->offset;
+
+	if (!parse_block_header<bigendian>(pos, block, max))
+		return false;
+
+	parse_block_children<bigendian>(block, max, level);
+	return true;
+}
+
+bool
+PTFFormat::parse_block_at(uint32_t pos, struct block_t *block, struct block_t *parent, int level) {
+	if (is_bigendian)
+		return parse_block_at<true>(pos, block, parent, level);
+	return parse_block_at<false>(pos, block, parent, level);
+}
+
+void
+PTFFormat::dump_block(struct block_t& b, int level)
 {
+	int i;
+
+	for (i = 0; i < level; i++) {
+		printf("    ");
+	}
+	printf("%s(0x%04x)\n", get_content_description(b.content_type).c_str(), b.content_type);
+	hexdump(&_ptfunxored[b.offset], b.block_size, level);
+
 	for (vector<PTFFormat::block_t>::iterator c = b.child.begin();
 			c != b.child.end(); ++c) {
-		free_block(*c);
+		dump_block(*c, level + 1);
 	}
-
-	b.child.clear();
 }
 
 void
 PTFFormat::free_all_blocks(void)
 {
-	for (vector<PTFFormat::block_t>::iterator b = blocks.begin();
-			b != blocks.end(); ++b) {
-		free_block(*b);
-	}
-
-	blocks.clear();
+	std::vector<block_t>().swap(blocks);
+	_scan.wavlengths.clear();
+	_scan.miditracks.clear();
+	_scan.placements.clear();
+	_scan.chunks.clear();
+	_scan.midiregions.clear();
+	_scan.compound.clear();
+	_scan.midiplacements.clear();
 }
 
 void
@@ -608,22 +1769,240 @@ PTFFormat::dump(void) {
 	}
 }
 
+uint64_t
+PTFFormat::hash_block(struct block_t& b)
+{
+	/* FNV-1a over the whole block including its header */
+	uint64_t h = 0xcbf29ce484222325ULL;
+	uint64_t i;
+
+	for (i = b.offset - 7; i < (uint64_t)b.offset + b.block_size; i++) {
+		h ^= _ptfunxored[i];
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+void
+PTFFormat::shift_block(struct block_t& b, int64_t delta)
+{
+	b.offset += delta;
+	for (vector<PTFFormat::block_t>::iterator c = b.child.begin();
+			c != b.child.end(); ++c) {
+		shift_block(*c, delta);
+	}
+}
+
 void
+PTFFormat::parseblocks(void) {
+	if (is_bigendian)
+		parseblocks<true>();
+	else
+		parseblocks<false>();
+}
+
+struct PTFFormat::blockjob_t {
+	PTFFormat*                   self;
+	std::vector<uint32_t> const* todo;	// indices into blocks
+	uint32_t                     next;	// first not yet taken
+};
+
+/* Orders indices into blocks largest block first */
+struct PTFFormat::larger_block {
+	std::vector<block_t> const& blocks;
+	larger_block (std::vector<block_t> const& b) : blocks (b) {}
+	bool operator() (uint32_t a, uint32_t b) const {
+		if (blocks[a].block_size != blocks[b].block_size)
+			return blocks[a].block_size > blocks[b].block_size;
+		return a < b;
+	}
+};
+
+template <bool bigendian> void*
+PTFFormat::blocks_job(void* arg) {
+	blockjob_t* job = (blockjob_t*) arg;
+	job->self->scan_subtrees<bigendian>(*job, false);
+	return NULL;
+}
+
+/* Scan subtrees until none are left or the load is cancelled, only
+ * the loading thread reports progress */
+template <bool bigendian> void
+PTFFormat::scan_subtrees(blockjob_t& job, bool report) {
+	const uint32_t n = job.todo->size();
+	const uint32_t reused = blocks.size() - n;
+	uint32_t k;
+
+	while (!_cancel && (k = __sync_fetch_and_add(&job.next, 1)) < n) {
+		if (report && !progress(PhaseBlocks, reused + k, blocks.size()))
+			return;
+		parse_block_children<bigendian>(&blocks[(*job.todo)[k]], _len, 0);
+	}
+}
+
+/* push_back() that moves the subtrees already in v when it grows,
+ * rather than copying them as C++98 vectors do */
+static void
+push_block(std::vector<PTFFormat::block_t>& v, PTFFormat::block_t const& b)
+{
+	if (v.size() == v.capacity()) {
+		std::vector<PTFFormat::block_t> bigger;
+		bigger.reserve(v.capacity() ? 2 * v.capacity() : 64);
+		bigger.resize(v.size());
+		for (uint32_t i = 0; i < v.size(); i++) {
+			bigger[i].zmark = v[i].zmark;
+			bigger[i].block_type = v[i].block_type;
+			bigger[i].block_size = v[i].block_size;
+			bigger[i].content_type = v[i].content_type;
+			bigger[i].offset = v[i].offset;
+			bigger[i].child.swap(v[i].child);
+		}
+		v.swap(bigger);
+	}
+	v.push_back(b);
+}
+
+/* Lay out each top-level block and scan its subtree as soon as it is
+ * decrypted, while the rest of the session is still being decrypted */
+template <bool bigendian> void
+PTFFormat::parseblocks_pipelined(void) {
+	uint64_t i = 20;
+	uint64_t have = 0;
+
+	while (i < _len) {
+		struct block_t b;
+		uint64_t need = std::min(i + 9, _len);
+		if (need > have && (have = wait_decrypted(need)) < need)
+			break;
+		b.block_size = 0;
+		if (parse_block_header<bigendian>(i, &b, _len)) {
+			need = (uint64_t)b.offset + b.block_size;
+			if (need > have && (have = wait_decrypted(need)) < need)
+				break;
+			push_block(blocks, b);
+			parse_block_children<bigendian>(&blocks.back(), _len, 0);
+			if (!progress(PhaseBlocks, i, _len))
+				break;
+		}
+		i += b.block_size ? b.block_size + 7 : 1;
+	}
+	_decrypted = unxor_finish();
+}
+
+template <bool bigendian> void
 PTFFormat::parseblocks(void) {
 	uint32_t i = 20;
+	std::map<uint64_t, uint32_t> prevhash;
+	std::vector<bool> taken;
+
+	if (_pipe) {
+		parseblocks_pipelined<bigendian>();
+		return;
+	}
+
+	if (_prev) {
+		for (uint32_t n = 0; n < _prev->blocks.size(); n++) {
+			prevhash.insert(std::make_pair(_prev->blockhash[n], n));
+		}
+		taken.resize(_prev->blocks.size(), false);
+	}
 
+	/* Lay out the top-level blocks first, see parse_block_children() */
 	while (i < _len) {
 		struct block_t b;
-		if (parse_block_at(i, &b, NULL, 0)) {
+		b.block_size = 0;
+		if (parse_block_header<bigendian>(i, &b, _len)) {
 			blocks.push_back(b);
 		}
 		i += b.block_size ? b.block_size + 7 : 1;
 	}
+
+	std::vector<uint32_t> todo;
+	uint64_t bytes = 0;
+	uint32_t k;
+
+	for (vector<PTFFormat::block_t>::iterator b = blocks.begin();
+			b != blocks.end(); ++b) {
+		if (_prev) {
+			/* Take the subtree of an identical block from the
+			 * previous revision instead of rescanning it */
+			uint64_t hash = hash_block(*b);
+			std::map<uint64_t, uint32_t>::iterator p = prevhash.find(hash);
+			_blockhash.push_back(hash);
+			if (p != prevhash.end() && !taken[p->second]) {
+				struct block_t& old = _prev->blocks[p->second];
+				if (old.block_size == b->block_size &&
+						old.content_type == b->content_type) {
+					taken[p->second] = true;
+					b->child.swap(old.child);
+					for (vector<PTFFormat::block_t>::iterator c = b->child.begin();
+							c != b->child.end(); ++c) {
+						shift_block(*c, (int64_t)b->offset - old.offset);
+					}
+					continue;
+				}
+			}
+		}
+		todo.push_back(b - blocks.begin());
+		bytes += b->block_size;
+	}
+
+	/* The subtrees of the top-level blocks are independent, workers
+	 * take the next one to scan until none are left.  Each fills in
+	 * the children of its own block so the tree stays in file order.
+	 */
+	blockjob_t job;
+	std::vector<pthread_t> workers;
+	job.self = this;
+	job.todo = &todo;
+	job.next = 0;
+	if (_jobs > 1 && bytes >= _parallel_bytes) {
+		/* Largest first so that none is left for last */
+		std::sort(todo.begin(), todo.end(), larger_block(blocks));
+		for (k = 1; k < _jobs && k < todo.size(); k++) {
+			pthread_t t;
+			if (pthread_create(&t, NULL, blocks_job<bigendian>, &job))
+				break;
+			workers.push_back(t);
+		}
+	}
+	scan_subtrees<bigendian>(job, true);
+	for (k = 0; k < workers.size(); k++) {
+		pthread_join(workers[k], NULL);
+	}
+}
+
+bool
+PTFFormat::unchanged_since_prev(const uint16_t *ctypes, int n)
+{
+	std::vector<uint64_t> before, after;
+	int k;
+
+	if (!_prev)
+		return false;
+
+	for (uint32_t i = 0; i < _prev->blocks.size(); i++) {
+		for (k = 0; k < n; k++) {
+			if (_prev->blocks[i].content_type == ctypes[k]) {
+				before.push_back(_prev->blockhash[i]);
+			}
+		}
+	}
+	for (uint32_t i = 0; i < blocks.size(); i++) {
+		for (k = 0; k < n; k++) {
+			if (blocks[i].content_type == ctypes[k]) {
+				after.push_back(_blockhash[i]);
+			}
+		}
+	}
+	return before == after;
 }
 
 int
 PTFFormat::parse(void) {
 	parseblocks();
+	if (_cancel)
+		return -6;
 #ifdef DEBUG
 	dump();
 #endif
@@ -632,15 +2011,133 @@ PTFFormat::parse(void) {
 	setrates();
 	if (_sessionrate < 44100 || _sessionrate > 192000)
 		return -2;
-	if (!parseaudio())
+	if (_prev && (_prev->sessionrate != _sessionrate ||
+			_prev->targetrate != _targetrate)) {
+		_prev = NULL;
+	}
+
+	/* Inputs of the passes whose results reload() can carry over */
+	static const uint16_t audio_blocks[] = { 0x1004 };
+	static const uint16_t region_blocks[] = { 0x1004, 0x100b, 0x262a };
+	static const uint16_t midi_blocks[] = { 0x2000 };
+
+	if (!progress(PhaseAudio, 0, 1))
+		return -6;
+	_scan.audio = !unchanged_since_prev(audio_blocks, 1);
+	_scan.regions = !unchanged_since_prev(region_blocks, 3);
+	_scan.midichunks = !unchanged_since_prev(midi_blocks, 1);
+	if (!_scan.audio) {
+		_audiofiles.swap(_prev->audiofiles);
+	}
+	if (!_scan.regions) {
+		_regions.swap(_prev->regions);
+	}
+	scanblocks();
+
+	/* The MIDI events are all parsemidi() needs from the blocks and
+	 * nothing else uses them, so they can be read alongside */
+	pthread_t midi;
+	bool concurrent = _jobs > 1 && _scan.midichunks && !_scan.chunks.empty() &&
+		!_visitor && !_budget_ms &&
+		!pthread_create(&midi, NULL, midichunks_job, this);
+
+	int err = parsetracks();
+	if (concurrent)
+		pthread_join(midi, NULL);
+	if (err)
+		return err;
+
+	if (!progress(PhaseMidi, 0, 1))
+		return -6;
+	if (out_of_time()) {
+		/* Only placeholders so far, see parsemidi() */
+		_miditracks.clear();
+		_partial = true;
+		return 0;
+	}
+	if (!_scan.midichunks) {
+		_midichunks.swap(_prev->midichunks);
+	} else if (!concurrent) {
+		parsemidichunks();
+	}
+	if (!parsemidi())
+		return -5;
+	return 0;
+}
+
+/* Audio files, regions, compounds and tracks, see parse() */
+int
+PTFFormat::parsetracks(void) {
+	if (_scan.audio && !parseaudio()) {
 		return -3;
+	}
+	if (!progress(PhaseRegions, 0, 1))
+		return -6;
+	if (_scan.regions) {
+		parseregions();
+	}
+	parsecompounds();
+	if (!progress(PhaseTracks, 0, 1))
+		return -6;
 	if (!parserest())
 		return -4;
-	if (!parsemidi())
-		return -5;
 	return 0;
 }
 
+void*
+PTFFormat::midichunks_job(void* arg) {
+	((PTFFormat*) arg)->parsemidichunks();
+	return NULL;
+}
+
+const PTFFormat::dispatch_t PTFFormat::scan_table[] = {
+	{ 0x1004, &PTFFormat::scan_audio,   NULL },
+	{ 0x100b, &PTFFormat::scan_regions, NULL },
+	{ 0x262a, &PTFFormat::scan_regions, NULL },
+	{ 0x1015, &PTFFormat::scan_tracks,  NULL },
+	{ 0x2519, NULL, &PTFFormat::scan_t::miditracks },
+	{ 0x1012, NULL, &PTFFormat::scan_t::placements },
+	{ 0x1054, NULL, &PTFFormat::scan_t::placements },
+	{ 0x2000, NULL, &PTFFormat::scan_t::chunks },
+	{ 0x2002, NULL, &PTFFormat::scan_t::midiregions },
+	{ 0x2634, NULL, &PTFFormat::scan_t::midiregions },
+	{ 0x262c, NULL, &PTFFormat::scan_t::compound },
+	{ 0x1058, NULL, &PTFFormat::scan_t::midiplacements },
+};
+
+/* The only walk over the top-level blocks after parseblocks().
+ * Blocks that need nothing from other blocks are parsed right away,
+ * the rest are listed for the fix-up passes (parseaudio() to
+ * parsemidi()) which then only look at those.
+ */
+void
+PTFFormat::scanblocks(void) {
+	const uint32_t n = sizeof(scan_table) / sizeof(scan_table[0]);
+	uint32_t i;
+
+	_scan.wavsfound = false;
+	_scan.regionsfound = false;
+	_scan.nwavs = 0;
+
+	for (vector<PTFFormat::block_t>::const_iterator b = blocks.begin();
+			b != blocks.end(); ++b) {
+		for (i = 0; i < n; i++) {
+			if (scan_table[i].content_type == b->content_type) {
+				break;
+			}
+		}
+		if (i == n) {
+			continue;
+		}
+		dispatch_t const& d = scan_table[i];
+		if (d.fn) {
+			(this->*d.fn)(*b);
+		} else {
+			(_scan.*d.list).push_back(&*b);
+		}
+	}
+}
+
 bool
 PTFFormat::parseheader(void) {
 	bool found = false;
@@ -655,6 +2152,11 @@ PTFFormat::parseheader(void) {
 	return found;
 }
 
+uint32_t
+PTFFormat::stringlen (uint32_t pos) {
+	return u_endian_read4(&_ptfunxored[pos], is_bigendian);
+}
+
 std::string
 PTFFormat::parsestring (uint32_t pos) {
 	uint32_t length = u_endian_read4(&_ptfunxored[pos], is_bigendian);
@@ -662,112 +2164,126 @@ PTFFormat::parsestring (uint32_t pos) {
 	return std::string((const char *)&_ptfunxored[pos], length);
 }
 
-bool
-PTFFormat::parseaudio(void) {
-	bool found = false;
-	uint32_t nwavs = 0;
+void
+PTFFormat::scan_audio(block_t const& b) {
+	uint32_t nwavs;
 	uint32_t i, n;
 	uint32_t pos = 0;
-	std::string wavtype;
-	std::string wavname;
+	const char *wavtype;
+	const char *wavname;
+	uint32_t namelen;
 
-	// Parse wav names
-	for (vector<PTFFormat::block_t>::iterator b = blocks.begin();
-			b != blocks.end(); ++b) {
-		if (b->content_type == 0x1004) {
-
-			nwavs = u_endian_read4(&_ptfunxored[b->offset+2], is_bigendian);
+	if (!_scan.audio) {
+		return;
+	}
 
-			for (vector<PTFFormat::block_t>::iterator c = b->child.begin();
-					c != b->child.end(); ++c) {
-				if (c->content_type == 0x103a) {
-					//nstrings = u_endian_read4(&_ptfunxored[c->offset+1], is_bigendian);
-					pos = c->offset + 11;
-					// Found wav list
-					for (i = n = 0; (pos < c->offset + c->block_size) && (n < nwavs); i++) {
-						wavname = parsestring(pos);
-						pos += wavname.size() + 4;
-						wavtype = std::string((const char*)&_ptfunxored[pos], 4);
-						pos += 9;
-						if (foundin(wavname, std::string(".grp")))
-							continue;
+	_scan.nwavs = nwavs = u_endian_read4(&_ptfunxored[b.offset+2], is_bigendian);
+	_audiofiles.reserve(_audiofiles.size() + nwavs);
+	_scan.wavlengths.push_back(std::vector<uint64_t>());
+	std::vector<uint64_t>& lengths = _scan.wavlengths.back();
 
-						if (foundin(wavname, std::string("Audio Files"))) {
-							continue;
-						}
-						if (foundin(wavname, std::string("Fade Files"))) {
+	for (vector<PTFFormat::block_t>::const_iterator c = b.child.begin();
+			c != b.child.end(); ++c) {
+		if (c->content_type == 0x103a) {
+			//nstrings = u_endian_read4(&_ptfunxored[c->offset+1], is_bigendian);
+			pos = c->offset + 11;
+			// Found wav list
+			for (i = n = 0; (pos < c->offset + c->block_size) && (n < nwavs); i++) {
+				/* Name and type are looked at in place,
+				 * only wavs that are kept get copied */
+				namelen = stringlen(pos);
+				wavname = (const char *)&_ptfunxored[pos + 4];
+				pos += namelen + 4;
+				wavtype = (const char *)&_ptfunxored[pos];
+				pos += 9;
+				if (foundin(wavname, namelen, ".grp", 4))
+					continue;
+
+				if (foundin(wavname, namelen, "Audio Files", 11)) {
+					continue;
+				}
+				if (foundin(wavname, namelen, "Fade Files", 10)) {
+					continue;
+				}
+				if (_version < 10) {
+					if (!(foundin(wavtype, 4, "WAVE", 4) ||
+							foundin(wavtype, 4, "EVAW", 4) ||
+							foundin(wavtype, 4, "AIFF", 4) ||
+							foundin(wavtype, 4, "FFIA", 4)) ) {
+						continue;
+					}
+				} else {
+					if (wavtype[0] != '\0') {
+						if (!(foundin(wavtype, 4, "WAVE", 4) ||
+								foundin(wavtype, 4, "EVAW", 4) ||
+								foundin(wavtype, 4, "AIFF", 4) ||
+								foundin(wavtype, 4, "FFIA", 4)) ) {
 							continue;
 						}
-						if (_version < 10) {
-							if (!(foundin(wavtype, std::string("WAVE")) ||
-									foundin(wavtype, std::string("EVAW")) ||
-									foundin(wavtype, std::string("AIFF")) ||
-									foundin(wavtype, std::string("FFIA"))) ) {
-								continue;
-							}
-						} else {
-							if (wavtype[0] != '\0') {
-								if (!(foundin(wavtype, std::string("WAVE")) ||
-										foundin(wavtype, std::string("EVAW")) ||
-										foundin(wavtype, std::string("AIFF")) ||
-										foundin(wavtype, std::string("FFIA"))) ) {
-									continue;
-								}
-							} else if (!(foundin(wavname, std::string(".wav")) || 
-									foundin(wavname, std::string(".aif"))) ) {
-								continue;
-							}
-						}
-						found = true;
-						wav_t f (n);
-						f.filename = wavname;
-						n++;
-						_audiofiles.push_back(f);
+					} else if (!(foundin(wavname, namelen, ".wav", 4) ||
+							foundin(wavname, namelen, ".aif", 4)) ) {
+						continue;
 					}
 				}
+				_scan.wavsfound = true;
+				_audiofiles.push_back(wav_t (n));
+				_audiofiles.back().filename.assign(wavname, namelen);
+				n++;
+			}
+		} else if (c->content_type == 0x1003) {
+			for (vector<PTFFormat::block_t>::const_iterator d = c->child.begin();
+					d != c->child.end(); ++d) {
+				if (d->content_type == 0x1001) {
+					lengths.push_back(u_endian_read8(&_ptfunxored[d->offset+8], is_bigendian));
+				}
 			}
 		}
 	}
+}
 
-	if (!found) {
-		if (nwavs > 0) {
+bool
+PTFFormat::parseaudio(void) {
+	if (!_scan.wavsfound) {
+		if (_scan.nwavs > 0) {
 			return false;
 		} else {
 			return true;
 		}
 	}
 
-	// Add wav length information
-	for (vector<PTFFormat::block_t>::iterator b = blocks.begin();
-			b != blocks.end(); ++b) {
-		if (b->content_type == 0x1004) {
-
-			vector<PTFFormat::wav_t>::iterator wav = _audiofiles.begin();
-
-			for (vector<PTFFormat::block_t>::iterator c = b->child.begin();
-					c != b->child.end(); ++c) {
-				if (c->content_type == 0x1003) {
-					for (vector<PTFFormat::block_t>::iterator d = c->child.begin();
-							d != c->child.end(); ++d) {
-						if (d->content_type == 0x1001) {
-							(*wav).length = u_endian_read8(&_ptfunxored[d->offset+8], is_bigendian);
-							wav++;
-						}
-					}
-				}
-			}
+	// Add wav length information, each 0x1004 numbers from the first wav
+	for (std::vector<std::vector<uint64_t> >::const_iterator l = _scan.wavlengths.begin();
+			l != _scan.wavlengths.end(); ++l) {
+		vector<PTFFormat::wav_t>::iterator wav = _audiofiles.begin();
+		for (std::vector<uint64_t>::const_iterator len = l->begin();
+				len != l->end() && wav != _audiofiles.end(); ++len, ++wav) {
+			(*wav).length = *len;
 		}
 	}
 
-	return found;
+	if (_visitor) {
+		for (vector<PTFFormat::wav_t>::iterator w = _audiofiles.begin();
+				w != _audiofiles.end(); ++w) {
+			_visitor->on_wav(*w);
+		}
+	}
+	return true;
 }
 
 
 void
+PTFFormat::parse_three_point(uint32_t j, uint64_t& start, uint64_t& offset, uint64_t& length) {
+	if (is_bigendian)
+		parse_three_point<true>(j, start, offset, length);
+	else
+		parse_three_point<false>(j, start, offset, length);
+}
+
+template <bool bigendian> void
 PTFFormat::parse_three_point(uint32_t j, uint64_t& start, uint64_t& offset, uint64_t& length) {
 	uint8_t offsetbytes, lengthbytes, startbytes;
 
-	if (is_bigendian) {
+	if (bigendian) {
 		offsetbytes = (_ptfunxored[j+4] & 0xf0) >> 4;
 		lengthbytes = (_ptfunxored[j+3] & 0xf0) >> 4;
 		startbytes = (_ptfunxored[j+2] & 0xf0) >> 4;
@@ -783,16 +2299,16 @@ PTFFormat::parse_three_point(uint32_t j, uint64_t& start, uint64_t& offset, uint
 
 	switch (offsetbytes) {
 	case 5:
-		offset = u_endian_read5(&_ptfunxored[j+5], false);
+		offset = u_endian_read5<false>(&_ptfunxored[j+5]);
 		break;
 	case 4:
-		offset = (uint64_t)u_endian_read4(&_ptfunxored[j+5], false);
+		offset = (uint64_t)u_endian_read4<false>(&_ptfunxored[j+5]);
 		break;
 	case 3:
-		offset = (uint64_t)u_endian_read3(&_ptfunxored[j+5], false);
+		offset = (uint64_t)u_endian_read3<false>(&_ptfunxored[j+5]);
 		break;
 	case 2:
-		offset = (uint64_t)u_endian_read2(&_ptfunxored[j+5], false);
+		offset = (uint64_t)u_endian_read2<false>(&_ptfunxored[j+5]);
 		break;
 	case 1:
 		offset = (uint64_t)(_ptfunxored[j+5]);
@@ -804,16 +2320,16 @@ PTFFormat::parse_three_point(uint32_t j, uint64_t& start, uint64_t& offset, uint
 	j+=offsetbytes;
 	switch (lengthbytes) {
 	case 5:
-		length = u_endian_read5(&_ptfunxored[j+5], false);
+		length = u_endian_read5<false>(&_ptfunxored[j+5]);
 		break;
 	case 4:
-		length = (uint64_t)u_endian_read4(&_ptfunxored[j+5], false);
+		length = (uint64_t)u_endian_read4<false>(&_ptfunxored[j+5]);
 		break;
 	case 3:
-		length = (uint64_t)u_endian_read3(&_ptfunxored[j+5], false);
+		length = (uint64_t)u_endian_read3<false>(&_ptfunxored[j+5]);
 		break;
 	case 2:
-		length = (uint64_t)u_endian_read2(&_ptfunxored[j+5], false);
+		length = (uint64_t)u_endian_read2<false>(&_ptfunxored[j+5]);
 		break;
 	case 1:
 		length = (uint64_t)(_ptfunxored[j+5]);
@@ -825,16 +2341,16 @@ PTFFormat::parse_three_point(uint32_t j, uint64_t& start, uint64_t& offset, uint
 	j+=lengthbytes;
 	switch (startbytes) {
 	case 5:
-		start = u_endian_read5(&_ptfunxored[j+5], false);
+		start = u_endian_read5<false>(&_ptfunxored[j+5]);
 		break;
 	case 4:
-		start = (uint64_t)u_endian_read4(&_ptfunxored[j+5], false);
+		start = (uint64_t)u_endian_read4<false>(&_ptfunxored[j+5]);
 		break;
 	case 3:
-		start = (uint64_t)u_endian_read3(&_ptfunxored[j+5], false);
+		start = (uint64_t)u_endian_read3<false>(&_ptfunxored[j+5]);
 		break;
 	case 2:
-		start = (uint64_t)u_endian_read2(&_ptfunxored[j+5], false);
+		start = (uint64_t)u_endian_read2<false>(&_ptfunxored[j+5]);
 		break;
 	case 1:
 		start = (uint64_t)(_ptfunxored[j+5]);
@@ -846,150 +2362,258 @@ PTFFormat::parse_three_point(uint32_t j, uint64_t& start, uint64_t& offset, uint
 }
 
 void
-PTFFormat::parse_region_info(uint32_t j, block_t& blk, region_t& r) {
+PTFFormat::parse_region_info(uint32_t j, block_t const& blk, region_t& r) {
 	uint64_t findex, start, sampleoffset, length;
 
 	parse_three_point(j, start, sampleoffset, length);
 
 	findex = u_endian_read4(&_ptfunxored[blk.offset + blk.block_size], is_bigendian);
-	wav_t f (findex);
-	f.posabsolute = start * _ratefactor;
-	f.length = length * _ratefactor;
-
-	wav_t found;
-	if (find_wav(findex, found)) {
-		f.filename = found.filename;
-	}
+	r.wave.index = findex;
+	r.wave.posabsolute = start * _ratefactor;
+	r.wave.length = length * _ratefactor;
 
-	std::vector<midi_ev_t> m;
 	r.startpos = (int64_t)(start*_ratefactor);
 	r.sampleoffset = (int64_t)(sampleoffset*_ratefactor);
 	r.length = (int64_t)(length*_ratefactor);
-	r.wave = f;
-	r.midi = m;
 }
 
-bool
-PTFFormat::parserest(void) {
-	uint32_t i, j, count;
-	uint64_t start;
-	uint16_t rindex, rawindex, tindex, mindex;
-	uint32_t nch;
-	uint16_t ch_map[MAX_CHANNELS_PER_TRACK];
-	bool found = false;
-	bool region_is_fade = false;
-	std::string regionname, trackname, midiregionname;
-	rindex = 0;
+void
+PTFFormat::scan_regions(block_t const& b) {
+	uint32_t j;
+
+	_scan.regionsfound = true;
+	if (!_scan.regions) {
+		return;
+	}
+
+	// Parse sources->regions, wav names are filled in by parseregions()
+	//nregions = u_endian_read4(&_ptfunxored[b.offset+2], is_bigendian);
+	for (vector<PTFFormat::block_t>::const_iterator c = b.child.begin();
+			c != b.child.end(); ++c) {
+		if (c->content_type == 0x1008 || c->content_type == 0x2629) {
+			vector<PTFFormat::block_t>::const_iterator d = c->child.begin();
+			_regions.push_back(region_t (_regions.size()));
+			region_t& r = _regions.back();
 
-	// Parse sources->regions
-	for (vector<PTFFormat::block_t>::iterator b = blocks.begin();
-			b != blocks.end(); ++b) {
-		if (b->content_type == 0x100b || b->content_type == 0x262a) {
-			//nregions = u_endian_read4(&_ptfunxored[b->offset+2], is_bigendian);
-			for (vector<PTFFormat::block_t>::iterator c = b->child.begin();
-					c != b->child.end(); ++c) {
-				if (c->content_type == 0x1008 || c->content_type == 0x2629) {
-					vector<PTFFormat::block_t>::iterator d = c->child.begin();
-					region_t r;
+			j = c->offset + 11;
+			r.name.assign((const char *)&_ptfunxored[j + 4], stringlen(j));
+			j += r.name.size() + 4;
 
-					found = true;
-					j = c->offset + 11;
-					regionname = parsestring(j);
-					j += regionname.size() + 4;
+			parse_region_info(j, *d, r);
+		}
+	}
+}
 
-					r.name = regionname;
-					r.index = rindex;
-					parse_region_info(j, *d, r);
+void
+PTFFormat::parseregions(void) {
+	for (std::vector<region_t>::iterator r = _regions.begin();
+			r != _regions.end(); ++r) {
+		std::vector<wav_t>::const_iterator found = std::find(_audiofiles.begin(), _audiofiles.end(), r->wave);
+		if (found != _audiofiles.end()) {
+			r->wave.filename = found->filename;
+		}
+		if (_visitor)
+			_visitor->on_region(*r);
+	}
+}
 
-					_regions.push_back(r);
-					rindex++;
+/* Compound groups and their elements, as references only, see
+ * compounds().  Same layout as the compound MIDI regions of
+ * parsemidi(): the group number follows the group block, an element
+ * holds the region number at 39 and its start and end in ticks from
+ * ZERO_TICKS at 51 and 59.
+ */
+void
+PTFFormat::parsecompounds(void) {
+	uint64_t start, offset, length;
+	uint32_t i, k, j, end;
+
+	for (std::vector<const block_t*>::const_iterator bi = _scan.compound.begin();
+			bi != _scan.compound.end(); ++bi) {
+		const block_t *b = *bi;
+		for (vector<PTFFormat::block_t>::const_iterator c = b->child.begin();
+				c != b->child.end(); ++c) {
+			if (c->content_type != 0x262b)
+				continue;
+			end = c->offset + c->block_size;
+			for (vector<PTFFormat::block_t>::const_iterator d = c->child.begin();
+					d != c->child.end(); ++d) {
+				std::vector<compound_element_t> elements;
+
+				if (d->content_type != 0x2628)
+					continue;
+				for (vector<PTFFormat::block_t>::const_iterator e = d->child.begin();
+						e != d->child.end(); ++e) {
+					if (e->content_type != 0x2523 || e->block_size < 64)
+						continue;
+					compound_element_t el;
+					j = e->offset + 39;
+					el.ref = u_endian_read4(&_ptfunxored[j], is_bigendian);
+					j += 12;
+					el.start = (int64_t)u_endian_read5(&_ptfunxored[j], is_bigendian) - (int64_t)ZERO_TICKS;
+					j += 8;
+					el.end = (int64_t)u_endian_read5(&_ptfunxored[j], is_bigendian) - (int64_t)ZERO_TICKS;
+					if (el.start < 0)
+						el.start = -el.start;
+					if (el.end < 0)
+						el.end = -el.end;
+					/* As MIDI placements, see parsemidi() */
+					el.start = (int64_t)(el.start * _ratefactor);
+					el.end = (int64_t)(el.end * _ratefactor);
+					elements.push_back(el);
 				}
+				if (elements.empty())
+					continue;
+
+				_compounds.push_back(compound_t ());
+				compound_t& g = _compounds.back();
+				j = d->offset + 2;
+				if (!parsestring(j, d->offset + d->block_size, g.name)) {
+					_compounds.pop_back();
+					continue;
+				}
+				j += 4 + g.name.size();
+				parse_three_point(j, start, offset, length);
+				g.startpos = (int64_t)(start*_ratefactor);
+				g.sampleoffset = (int64_t)(offset*_ratefactor);
+				g.length = (int64_t)(length*_ratefactor);
+				j = d->offset + d->block_size + 2;
+				if (j + 2 <= end)
+					g.index = u_endian_read2(&_ptfunxored[j], is_bigendian);
+				g.elements.swap(elements);
 			}
-			found = true;
 		}
 	}
 
+	/* An element refers to a compound when one has its number,
+	 * otherwise to the region of that number */
+	std::vector<std::pair<uint32_t, uint32_t> > numbers;
+	numbers.reserve(_compounds.size());
+	for (i = 0; i < _compounds.size(); i++) {
+		numbers.push_back(std::make_pair((uint32_t)_compounds[i].index, i));
+	}
+	std::sort(numbers.begin(), numbers.end());
+	for (i = 0; i < _compounds.size(); i++) {
+		std::vector<compound_element_t>& els = _compounds[i].elements;
+		for (k = 0; k < els.size(); k++) {
+			std::vector<std::pair<uint32_t, uint32_t> >::const_iterator n =
+				std::lower_bound(numbers.begin(), numbers.end(),
+						std::make_pair(els[k].ref, (uint32_t)0));
+			if (n != numbers.end() && n->first == els[k].ref && n->second != i) {
+				els[k].compound = n->second;
+			} else if (els[k].ref < _regions.size()) {
+				els[k].region = els[k].ref;
+			}
+		}
+	}
+	_flat.resize(_compounds.size());
+	_flatstate.assign(_compounds.size(), 0);
+}
+
+/* The compound placed by a region map entry of this number, or -1 */
+int32_t
+PTFFormat::find_compound(uint32_t number) const {
+	for (uint32_t i = 0; i < _compounds.size(); i++) {
+		if (_compounds[i].index == number)
+			return i;
+	}
+	return -1;
+}
+
+void
+PTFFormat::scan_tracks(block_t const& b) {
+	uint32_t i, j;
+	uint32_t nch, namelen;
+	uint16_t ch_map[MAX_CHANNELS_PER_TRACK];
+	const char *trackname;
+
 	// Parse tracks
-	for (vector<PTFFormat::block_t>::iterator b = blocks.begin();
-			b != blocks.end(); ++b) {
-		if (b->content_type == 0x1015) {
-			//ntracks = u_endian_read4(&_ptfunxored[b->offset+2], is_bigendian);
-			for (vector<PTFFormat::block_t>::iterator c = b->child.begin();
-					c != b->child.end(); ++c) {
-				if (c->content_type == 0x1014) {
-					j = c->offset + 2;
-					trackname = parsestring(j);
-					j += trackname.size() + 5;
-					nch = u_endian_read4(&_ptfunxored[j], is_bigendian);
-					j += 4;
-					for (i = 0; i < nch; i++) {
-						ch_map[i] = u_endian_read2(&_ptfunxored[j], is_bigendian);
-
-						track_t ti;
-						if (!find_track(ch_map[i], ti)) {
-							// Add a dummy region for now
-							region_t r (65535);
-							track_t t (ch_map[i]);
-							t.name = trackname;
-							t.reg = r;
-							_tracks.push_back(t);
-						}
-						//verbose_printf("%s : %d(%d)\n", reg, nch, ch_map[0]);
-						j += 2;
-					}
+	//ntracks = u_endian_read4(&_ptfunxored[b.offset+2], is_bigendian);
+	for (vector<PTFFormat::block_t>::const_iterator c = b.child.begin();
+			c != b.child.end(); ++c) {
+		if (c->content_type == 0x1014) {
+			j = c->offset + 2;
+			namelen = stringlen(j);
+			trackname = (const char *)&_ptfunxored[j + 4];
+			j += namelen + 5;
+			nch = u_endian_read4(&_ptfunxored[j], is_bigendian);
+			j += 4;
+			for (i = 0; i < nch; i++) {
+				ch_map[i] = u_endian_read2(&_ptfunxored[j], is_bigendian);
+
+				track_t t (ch_map[i]);
+				if (std::find(_tracks.begin(), _tracks.end(), t) == _tracks.end()) {
+					// Add a dummy region for now
+					_tracks.push_back(t);
+					_tracks.back().name.assign(trackname, namelen);
+					_tracks.back().reg.index = 65535;
 				}
+				//verbose_printf("%s : %d(%d)\n", reg, nch, ch_map[0]);
+				j += 2;
 			}
 		}
 	}
+}
 
-	// Reparse from scratch to exclude audio tracks from all tracks to get midi tracks
-	for (vector<PTFFormat::block_t>::iterator b = blocks.begin();
-			b != blocks.end(); ++b) {
-		if (b->content_type == 0x2519) {
-			tindex = 0;
-			mindex = 0;
-			//ntracks = u_endian_read4(&_ptfunxored[b->offset+2], is_bigendian);
-			for (vector<PTFFormat::block_t>::iterator c = b->child.begin();
-					c != b->child.end(); ++c) {
-				if (c->content_type == 0x251a) {
-					j = c->offset + 4;
-					trackname = parsestring(j);
-					j += trackname.size() + 4 + 18;
-					//tindex = u_endian_read4(&_ptfunxored[j], is_bigendian);
+bool
+PTFFormat::parserest(void) {
+	uint32_t j, count;
+	uint64_t start;
+	uint16_t rawindex, tindex, mindex;
+	uint32_t namelen;
+	bool found = _scan.regionsfound;
+	bool region_is_fade = false;
+	const char *trackname;
 
+	// Reparse from scratch to exclude audio tracks from all tracks to get midi tracks
+	for (std::vector<const block_t*>::const_iterator bi = _scan.miditracks.begin();
+			bi != _scan.miditracks.end(); ++bi) {
+		const block_t *b = *bi;
+		tindex = 0;
+		mindex = 0;
+		//ntracks = u_endian_read4(&_ptfunxored[b->offset+2], is_bigendian);
+		for (vector<PTFFormat::block_t>::const_iterator c = b->child.begin();
+				c != b->child.end(); ++c) {
+			if (c->content_type == 0x251a) {
+				j = c->offset + 4;
+				namelen = stringlen(j);
+				trackname = (const char *)&_ptfunxored[j + 4];
+				j += namelen + 4 + 18;
+				//tindex = u_endian_read4(&_ptfunxored[j], is_bigendian);
+
+				track_t ti (tindex);
+				std::vector<track_t>::const_iterator found = std::find(_tracks.begin(), _tracks.end(), ti);
+
+				// If the current track is not an audio track, insert as midi track
+				if (!(found != _tracks.end() && foundin(trackname, namelen,
+							found->name.data(), found->name.size()))) {
 					// Add a dummy region for now
-					region_t r (65535);
-					track_t t (mindex);
-					t.name = trackname;
-					t.reg = r;
-
-					track_t ti;
-					// If the current track is not an audio track, insert as midi track
-					if (!(find_track(tindex, ti) && foundin(trackname, ti.name))) {
-						_miditracks.push_back(t);
-						mindex++;
-					}
-					tindex++;
+					_miditracks.push_back(track_t (mindex));
+					_miditracks.back().name.assign(trackname, namelen);
+					_miditracks.back().reg.index = 65535;
+					mindex++;
 				}
+				tindex++;
 			}
 		}
 	}
 
 	// Parse regions->tracks
-	for (vector<PTFFormat::block_t>::iterator b = blocks.begin();
-			b != blocks.end(); ++b) {
+	for (std::vector<const block_t*>::const_iterator bi = _scan.placements.begin();
+			bi != _scan.placements.end(); ++bi) {
+		const block_t *b = *bi;
 		tindex = 0;
 		if (b->content_type == 0x1012) {
 			//nregions = u_endian_read4(&_ptfunxored[b->offset+2], is_bigendian);
 			count = 0;
-			for (vector<PTFFormat::block_t>::iterator c = b->child.begin();
+			for (vector<PTFFormat::block_t>::const_iterator c = b->child.begin();
 					c != b->child.end(); ++c) {
 				if (c->content_type == 0x1011) {
-					regionname = parsestring(c->offset + 2);
-					for (vector<PTFFormat::block_t>::iterator d = c->child.begin();
+					//regionname = parsestring(c->offset + 2);
+					for (vector<PTFFormat::block_t>::const_iterator d = c->child.begin();
 							d != c->child.end(); ++d) {
 						if (d->content_type == 0x100f) {
-							for (vector<PTFFormat::block_t>::iterator e = d->child.begin();
+							for (vector<PTFFormat::block_t>::const_iterator e = d->child.begin();
 									e != d->child.end(); ++e) {
 								if (e->content_type == 0x100e) {
 									// Region->track
@@ -1014,11 +2638,11 @@ PTFFormat::parserest(void) {
 		} else if (b->content_type == 0x1054) {
 			//nregions = u_endian_read4(&_ptfunxored[b->offset+2], is_bigendian);
 			count = 0;
-			for (vector<PTFFormat::block_t>::iterator c = b->child.begin();
+			for (vector<PTFFormat::block_t>::const_iterator c = b->child.begin();
 					c != b->child.end(); ++c) {
 				if (c->content_type == 0x1052) {
-					trackname = parsestring(c->offset + 2);
-					for (vector<PTFFormat::block_t>::iterator d = c->child.begin();
+					//trackname = parsestring(c->offset + 2);
+					for (vector<PTFFormat::block_t>::const_iterator d = c->child.begin();
 							d != c->child.end(); ++d) {
 						if (d->content_type == 0x1050) {
 							region_is_fade = (_ptfunxored[d->offset + 46] == 0x01);
@@ -1026,7 +2650,7 @@ PTFFormat::parserest(void) {
 								verbose_printf("dropped fade region\n");
 								continue;
 							}
-							for (vector<PTFFormat::block_t>::iterator e = d->child.begin();
+							for (vector<PTFFormat::block_t>::const_iterator e = d->child.begin();
 									e != d->child.end(); ++e) {
 								if (e->content_type == 0x104f) {
 									// Region->track
@@ -1041,7 +2665,14 @@ PTFFormat::parserest(void) {
 										continue;
 									}
 									if (!find_region(rawindex, ti.reg)) {
-										verbose_printf("dropped region %d\n", rawindex);
+										int32_t k = find_compound(rawindex);
+										if (k < 0) {
+											verbose_printf("dropped region %d\n", rawindex);
+											continue;
+										}
+										/* What the compound is made of */
+										ti.reg.startpos = start * _ratefactor;
+										place_compound(_compounds[k], flatten(k), _regions, ti, _tracks);
 										continue;
 									}
 									ti.reg.startpos = start * _ratefactor;
@@ -1102,81 +2733,97 @@ PTFFormat::parserest(void) {
 			(*tr).index -= first;
 		}
 	}
+
+	if (_visitor) {
+		for (std::vector<track_t>::iterator tr = _tracks.begin();
+				tr != _tracks.end(); tr++) {
+			_visitor->on_track_placement(*tr);
+		}
+	}
 	return found;
 }
 
-struct mchunk {
-	mchunk (uint64_t zt, uint64_t ml, std::vector<PTFFormat::midi_ev_t> const& c)
-	: zero (zt)
-	, maxlen (ml)
-	, chunk (c)
-	{}
-	uint64_t zero;
-	uint64_t maxlen;
-	std::vector<PTFFormat::midi_ev_t> chunk;
-};
+void
+PTFFormat::parsemidichunks(void) {
+	if (is_bigendian)
+		parsemidichunks<true>();
+	else
+		parsemidichunks<false>();
+}
 
-bool
-PTFFormat::parsemidi(void) {
-	uint32_t i, j, k, n, rindex, tindex, mindex, count, rawindex;
-	uint64_t n_midi_events, zero_ticks, start, offset, length, start2, stop2;
-	uint64_t midi_pos, midi_len, max_pos, region_pos;
+template <bool bigendian> void
+PTFFormat::parsemidichunks(void) {
+	uint32_t i, k;
+	uint64_t n_midi_events, zero_ticks;
+	uint64_t midi_pos, midi_len, max_pos;
 	uint8_t midi_velocity, midi_note;
-	uint16_t regionnumber = 0;
-	std::string midiregionname;
-
-	std::vector<mchunk> midichunks;
 	midi_ev_t m;
 
-	std::string regionname, trackname;
-	rindex = 0;
-
 	// Parse MIDI events
-	for (vector<PTFFormat::block_t>::iterator b = blocks.begin();
-			b != blocks.end(); ++b) {
-		if (b->content_type == 0x2000) {
+	for (std::vector<const block_t*>::const_iterator bi = _scan.chunks.begin();
+			bi != _scan.chunks.end(); ++bi) {
+		const block_t *b = *bi;
 
-			k = b->offset;
+		k = b->offset;
 
-			// Parse all midi chunks, not 1:1 mapping to regions yet
-			while (k + 35 < b->block_size + b->offset) {
-				max_pos = 0;
-				std::vector<midi_ev_t> midi;
+		// Parse all midi chunks, not 1:1 mapping to regions yet
+		while (k + 35 < b->block_size + b->offset) {
+			max_pos = 0;
+			std::vector<midi_ev_t> midi;
 
-				if (!jumpto(&k, _ptfunxored, _len, (const unsigned char *)"MdNLB", 5)) {
-					break;
+			if (!jumpto(&k, _ptfunxored, b->block_size + b->offset, (const unsigned char *)"MdNLB", 5)) {
+				break;
+			}
+			k += 11;
+			n_midi_events = u_endian_read4<bigendian>(&_ptfunxored[k]);
+
+			k += 4;
+			zero_ticks = u_endian_read5<bigendian>(&_ptfunxored[k]);
+			for (i = 0; i < n_midi_events && k < _len; i++, k += 35) {
+				midi_pos = u_endian_read5<bigendian>(&_ptfunxored[k]);
+				midi_pos -= zero_ticks;
+				midi_note = _ptfunxored[k+8];
+				midi_len = u_endian_read5<bigendian>(&_ptfunxored[k+9]);
+				midi_velocity = _ptfunxored[k+17];
+
+				if (midi_pos + midi_len > max_pos) {
+					max_pos = midi_pos + midi_len;
 				}
-				k += 11;
-				n_midi_events = u_endian_read4(&_ptfunxored[k], is_bigendian);
-
-				k += 4;
-				zero_ticks = u_endian_read5(&_ptfunxored[k], is_bigendian);
-				for (i = 0; i < n_midi_events && k < _len; i++, k += 35) {
-					midi_pos = u_endian_read5(&_ptfunxored[k], is_bigendian);
-					midi_pos -= zero_ticks;
-					midi_note = _ptfunxored[k+8];
-					midi_len = u_endian_read5(&_ptfunxored[k+9], is_bigendian);
-					midi_velocity = _ptfunxored[k+17];
-
-					if (midi_pos + midi_len > max_pos) {
-						max_pos = midi_pos + midi_len;
-					}
 
-					m.pos = midi_pos;
-					m.length = midi_len;
-					m.note = midi_note;
-					m.velocity = midi_velocity;
+				m.pos = midi_pos;
+				m.length = midi_len;
+				m.note = midi_note;
+				m.velocity = midi_velocity;
+				if (_visitor)
+					_visitor->on_midi_event(_midichunks.size(), m);
+				if (_keep_events)
 					midi.push_back(m);
-				}
-				midichunks.push_back(mchunk (zero_ticks, max_pos, midi));
 			}
+			_midichunks.push_back(mchunk (zero_ticks, max_pos, midi));
+		}
+	}
+}
+
+bool
+PTFFormat::parsemidi(void) {
+	uint32_t j, n, rindex, tindex, mindex, count, rawindex;
+	uint64_t zero_ticks, start, offset, length, start2, stop2;
+	uint64_t midi_len, region_pos;
+	uint16_t regionnumber = 0;
+	std::string midiregionname;
 
+	std::string regionname, trackname;
+	rindex = 0;
+
+	for (std::vector<const block_t*>::const_iterator bi = _scan.midiregions.begin();
+			bi != _scan.midiregions.end(); ++bi) {
+		const block_t *b = *bi;
 		// Put chunks onto regions
-		} else if ((b->content_type == 0x2002) || (b->content_type == 0x2634)) {
-			for (vector<PTFFormat::block_t>::iterator c = b->child.begin();
+		{
+			for (vector<PTFFormat::block_t>::const_iterator c = b->child.begin();
 					c != b->child.end(); ++c) {
 				if ((c->content_type == 0x2001) || (c->content_type == 0x2633)) {
-					for (vector<PTFFormat::block_t>::iterator d = c->child.begin();
+					for (vector<PTFFormat::block_t>::const_iterator d = c->child.begin();
 							d != c->child.end(); ++d) {
 						if ((d->content_type == 0x1007) || (d->content_type == 0x2628)) {
 							j = d->offset + 2;
@@ -1185,137 +2832,139 @@ PTFFormat::parsemidi(void) {
 							parse_three_point(j, region_pos, zero_ticks, midi_len);
 							j = d->offset + d->block_size;
 							rindex = u_endian_read4(&_ptfunxored[j], is_bigendian);
-							struct mchunk mc = *(midichunks.begin()+rindex);
+							const mchunk& mc = _midichunks[rindex];
 
-							region_t r (regionnumber++);
+							_midiregions.push_back(region_t (regionnumber++));
+							region_t& r = _midiregions.back();
 							r.name = midiregionname;
 							r.startpos = (int64_t)0xe8d4a51000ULL;
 							r.sampleoffset = 0;
 							r.length = mc.maxlen;
 							r.midi = mc.chunk;
+							if (_visitor)
+								_visitor->on_midi_region(rindex, r);
 
-							_midiregions.push_back(r);
 							//verbose_printf("MIDI %s : r(%d) (%llu, %llu, %llu)\n", str, rindex, zero_ticks, region_pos, midi_len);
 							//dump_block(*d, 1);
 						}
 					}
 				}
 			}
-		} 
+		}
 	}
 	
 	// COMPOUND MIDI regions
-	for (vector<PTFFormat::block_t>::iterator b = blocks.begin();
-			b != blocks.end(); ++b) {
-		if (b->content_type == 0x262c) {
-			mindex = 0;
-			for (vector<PTFFormat::block_t>::iterator c = b->child.begin();
-					c != b->child.end(); ++c) {
-				if (c->content_type == 0x262b) {
-					for (vector<PTFFormat::block_t>::iterator d = c->child.begin();
-							d != c->child.end(); ++d) {
-						if (d->content_type == 0x2628) {
-							count = 0;
-							j = d->offset + 2;
-							regionname = parsestring(j);
-							j += 4 + regionname.size();
-							parse_three_point(j, start, offset, length);
-							j = d->offset + d->block_size + 2;
-							n = u_endian_read2(&_ptfunxored[j], is_bigendian);
-
-							for (vector<PTFFormat::block_t>::iterator e = d->child.begin();
-									e != d->child.end(); ++e) {
-								if (e->content_type == 0x2523) {
-									// FIXME Compound MIDI region
-									j = e->offset + 39;
-									rawindex = u_endian_read4(&_ptfunxored[j], is_bigendian);
-									j += 12; 
-									start2 = u_endian_read5(&_ptfunxored[j], is_bigendian);
-									int64_t signedval = (int64_t)start2;
-									signedval -= ZERO_TICKS;
-									if (signedval < 0) {
-										signedval = -signedval;
-									}
-									start2 = signedval;
-									j += 8;
-									stop2 = u_endian_read5(&_ptfunxored[j], is_bigendian);
-									signedval = (int64_t)stop2;
-									signedval -= ZERO_TICKS;
-									if (signedval < 0) {
-										signedval = -signedval;
-									}
-									stop2 = signedval;
-									j += 16;
-									//nn = u_endian_read4(&_ptfunxored[j], is_bigendian);
-									//verbose_printf("COMPOUND %s : c(%d) r(%d) ?(%d) ?(%d) (%llu %llu)(%llu %llu %llu)\n", str, mindex, rawindex, n, nn, start2, stop2, start, offset, length);
-									count++;
+	for (std::vector<const block_t*>::const_iterator bi = _scan.compound.begin();
+			bi != _scan.compound.end(); ++bi) {
+		const block_t *b = *bi;
+		mindex = 0;
+		for (vector<PTFFormat::block_t>::const_iterator c = b->child.begin();
+				c != b->child.end(); ++c) {
+			if (c->content_type == 0x262b) {
+				for (vector<PTFFormat::block_t>::const_iterator d = c->child.begin();
+						d != c->child.end(); ++d) {
+					if (d->content_type == 0x2628) {
+						count = 0;
+						j = d->offset + 2;
+						regionname = parsestring(j);
+						j += 4 + regionname.size();
+						parse_three_point(j, start, offset, length);
+						j = d->offset + d->block_size + 2;
+						n = u_endian_read2(&_ptfunxored[j], is_bigendian);
+
+						for (vector<PTFFormat::block_t>::const_iterator e = d->child.begin();
+								e != d->child.end(); ++e) {
+							if (e->content_type == 0x2523) {
+								// FIXME Compound MIDI region
+								j = e->offset + 39;
+								rawindex = u_endian_read4(&_ptfunxored[j], is_bigendian);
+								j += 12; 
+								start2 = u_endian_read5(&_ptfunxored[j], is_bigendian);
+								int64_t signedval = (int64_t)start2;
+								signedval -= ZERO_TICKS;
+								if (signedval < 0) {
+									signedval = -signedval;
 								}
-							}
-							if (!count) {
-								// Plain MIDI region
-								struct mchunk mc = *(midichunks.begin()+n);
-
-								region_t r (n);
-								r.name = midiregionname;
-								r.startpos = (int64_t)0xe8d4a51000ULL;
-								r.length = mc.maxlen;
-								r.midi = mc.chunk;
-								_midiregions.push_back(r);
-								verbose_printf("%s : MIDI region mr(%d) ?(%d) (%lu %lu %lu)\n", regionname.c_str(), mindex, n, start, offset, length);
-								mindex++;
+								start2 = signedval;
+								j += 8;
+								stop2 = u_endian_read5(&_ptfunxored[j], is_bigendian);
+								signedval = (int64_t)stop2;
+								signedval -= ZERO_TICKS;
+								if (signedval < 0) {
+									signedval = -signedval;
+								}
+								stop2 = signedval;
+								j += 16;
+								//nn = u_endian_read4(&_ptfunxored[j], is_bigendian);
+								//verbose_printf("COMPOUND %s : c(%d) r(%d) ?(%d) ?(%d) (%llu %llu)(%llu %llu %llu)\n", str, mindex, rawindex, n, nn, start2, stop2, start, offset, length);
+								count++;
 							}
 						}
+						if (!count) {
+							// Plain MIDI region
+							const mchunk& mc = _midichunks[n];
+
+							_midiregions.push_back(region_t (n));
+							region_t& r = _midiregions.back();
+							r.name = midiregionname;
+							r.startpos = (int64_t)0xe8d4a51000ULL;
+							r.length = mc.maxlen;
+							r.midi = mc.chunk;
+							if (_visitor)
+								_visitor->on_midi_region(n, r);
+							verbose_printf("%s : MIDI region mr(%d) ?(%d) (%lu %lu %lu)\n", regionname.c_str(), mindex, n, start, offset, length);
+							mindex++;
+						}
 					}
 				}
 			}
-		} 
+		}
 	}
 	
 	// Put midi regions onto midi tracks
-	for (vector<PTFFormat::block_t>::iterator b = blocks.begin();
-			b != blocks.end(); ++b) {
-		if (b->content_type == 0x1058) {
-			//nregions = u_endian_read4(&_ptfunxored[b->offset+2], is_bigendian);
-			count = 0;
-			for (vector<PTFFormat::block_t>::iterator c = b->child.begin();
-					c != b->child.end(); ++c) {
-				if (c->content_type == 0x1057) {
-					regionname = parsestring(c->offset + 2);
-					for (vector<PTFFormat::block_t>::iterator d = c->child.begin();
-							d != c->child.end(); ++d) {
-						if (d->content_type == 0x1056) {
-							for (vector<PTFFormat::block_t>::iterator e = d->child.begin();
-									e != d->child.end(); ++e) {
-								if (e->content_type == 0x104f) {
-									// MIDI region->MIDI track
-									track_t ti;
-									j = e->offset + 4;
-									rawindex = u_endian_read4(&_ptfunxored[j], is_bigendian);
-									j += 4 + 1;
-									start = u_endian_read5(&_ptfunxored[j], is_bigendian);
-									tindex = count;
-									if (!find_miditrack(tindex, ti)) {
-										verbose_printf("dropped midi t(%d) r(%d)\n", tindex, rawindex);
-										continue;
-									}
-									if (!find_midiregion(rawindex, ti.reg)) {
-										verbose_printf("dropped midiregion\n");
-										continue;
-									}
-									//verbose_printf("MIDI : %s : t(%d) r(%d) %llu(%llu)\n", ti.name.c_str(), tindex, rawindex, start, ti.reg.startpos);
-									int64_t signedstart = (int64_t)(start - ZERO_TICKS);
-									if (signedstart < 0)
-										signedstart = -signedstart;
-									ti.reg.startpos = (uint64_t)(signedstart * _ratefactor);
-									if (ti.reg.index != 65535) {
-										_miditracks.push_back(ti);
-									}
+	for (std::vector<const block_t*>::const_iterator bi = _scan.midiplacements.begin();
+			bi != _scan.midiplacements.end(); ++bi) {
+		const block_t *b = *bi;
+		//nregions = u_endian_read4(&_ptfunxored[b->offset+2], is_bigendian);
+		count = 0;
+		for (vector<PTFFormat::block_t>::const_iterator c = b->child.begin();
+				c != b->child.end(); ++c) {
+			if (c->content_type == 0x1057) {
+				//regionname = parsestring(c->offset + 2);
+				for (vector<PTFFormat::block_t>::const_iterator d = c->child.begin();
+						d != c->child.end(); ++d) {
+					if (d->content_type == 0x1056) {
+						for (vector<PTFFormat::block_t>::const_iterator e = d->child.begin();
+								e != d->child.end(); ++e) {
+							if (e->content_type == 0x104f) {
+								// MIDI region->MIDI track
+								track_t ti;
+								j = e->offset + 4;
+								rawindex = u_endian_read4(&_ptfunxored[j], is_bigendian);
+								j += 4 + 1;
+								start = u_endian_read5(&_ptfunxored[j], is_bigendian);
+								tindex = count;
+								if (!find_miditrack(tindex, ti)) {
+									verbose_printf("dropped midi t(%d) r(%d)\n", tindex, rawindex);
+									continue;
+								}
+								if (!find_midiregion(rawindex, ti.reg)) {
+									verbose_printf("dropped midiregion\n");
+									continue;
+								}
+								//verbose_printf("MIDI : %s : t(%d) r(%d) %llu(%llu)\n", ti.name.c_str(), tindex, rawindex, start, ti.reg.startpos);
+								int64_t signedstart = (int64_t)(start - ZERO_TICKS);
+								if (signedstart < 0)
+									signedstart = -signedstart;
+								ti.reg.startpos = (uint64_t)(signedstart * _ratefactor);
+								if (ti.reg.index != 65535) {
+									_miditracks.push_back(ti);
 								}
 							}
 						}
 					}
-					count++;
 				}
+				count++;
 			}
 		}
 	}
@@ -1327,5 +2976,401 @@ PTFFormat::parsemidi(void) {
 			tr++;
 		}
 	}
+
+	if (_visitor) {
+		for (std::vector<track_t>::iterator tr = _miditracks.begin();
+				tr != _miditracks.end(); tr++) {
+			_visitor->on_midi_track_placement(*tr);
+		}
+	}
+	return true;
+}
+
+int64_t
+PTFFormat::index_maxend(std::vector<span_t>& spans, uint32_t lo, uint32_t hi) {
+	uint32_t mid = lo + (hi - lo) / 2;
+	int64_t m = spans[mid].end;
+
+	if (lo < mid)
+		m = std::max(m, index_maxend(spans, lo, mid));
+	if (mid + 1 < hi)
+		m = std::max(m, index_maxend(spans, mid + 1, hi));
+	spans[mid].maxend = m;
+	return m;
+}
+
+void
+PTFFormat::index_spans(std::vector<track_t> const& tracks, span_index_t& index) {
+	index.clear();
+	for (uint32_t i = 0; i < tracks.size(); i++) {
+		span_t s;
+		s.start = tracks[i].reg.startpos;
+		s.end = tracks[i].reg.startpos + tracks[i].reg.length;
+		s.maxend = s.end;
+		s.idx = i;
+		if (tracks[i].index >= index.size()) {
+			index.resize(tracks[i].index + 1);
+		}
+		index[tracks[i].index].push_back(s);
+	}
+	for (span_index_t::iterator t = index.begin(); t != index.end(); ++t) {
+		std::stable_sort(t->begin(), t->end());
+		if (!t->empty()) {
+			index_maxend(*t, 0, t->size());
+		}
+	}
+}
+
+void
+PTFFormat::index_placements(void) {
+	index_spans(_tracks, _trackspans);
+	index_spans(_miditracks, _miditrackspans);
+}
+
+void
+PTFFormat::query_spans(std::vector<span_t> const& spans, uint32_t lo, uint32_t hi,
+		int64_t start, int64_t end, std::vector<uint32_t>& out) {
+	uint32_t mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (spans[mid].maxend <= start)
+			return;
+		query_spans(spans, lo, mid, start, end, out);
+		if (spans[mid].start >= end)
+			return;
+		if (spans[mid].end > start)
+			out.push_back(spans[mid].idx);
+		lo = mid + 1;
+	}
+}
+
+void
+PTFFormat::placements_in(uint16_t track, int64_t start, int64_t end,
+		std::vector<uint32_t>& out, bool midi) const {
+	span_index_t const& index = midi ? _miditrackspans : _trackspans;
+
+	out.clear();
+	if (track < index.size()) {
+		query_spans(index[track], 0, index[track].size(), start, end, out);
+	}
+}
+
+void
+PTFFormat::placements_in(std::vector<range_t> const& queries,
+		std::vector<std::vector<uint32_t> >& out, bool midi) const {
+	out.resize(queries.size());
+	for (uint32_t i = 0; i < queries.size(); i++) {
+		placements_in(queries[i].track, queries[i].start, queries[i].end, out[i], midi);
+	}
+}
+
+void
+PTFFormat::add_name(name_index_t& names, std::string const& name, uint32_t idx) {
+	namekey_t k;
+	uint32_t i;
+
+	k.off = names.folded.size();
+	k.len = name.size();
+	k.idx = idx;
+	names.folded.resize(k.off + k.len);
+	for (i = 0; i < k.len; i++) {
+		names.folded[k.off + i] = tolower((unsigned char)name[i]);
+	}
+	k.prefix = 0;
+	for (i = 0; i < 8; i++) {
+		k.prefix = (k.prefix << 8) |
+			(i < k.len ? (unsigned char)names.folded[k.off + i] : 0);
+	}
+	names.keys.push_back(k);
+}
+
+void
+PTFFormat::sort_names(name_index_t& names) {
+	std::sort(names.keys.begin(), names.keys.end(), namekey_less(names.folded.data()));
+	names.order.resize(names.keys.size());
+	for (uint32_t i = 0; i < names.keys.size(); i++) {
+		names.order[i] = names.keys[i].idx;
+	}
+}
+
+int64_t
+PTFFormat::find_name(name_index_t& names, std::string const& name) {
+	int64_t found = -1;
+
+	/* The needle goes at the end of the folded names for the search
+	 * and is taken off again after */
+	add_name(names, name, 0);
+	namekey_t k = names.keys.back();
+	names.keys.pop_back();
+
+	namekey_less less(names.folded.data());
+	std::vector<namekey_t>::const_iterator i =
+		std::lower_bound(names.keys.begin(), names.keys.end(), k, less);
+	if (i != names.keys.end() && i->prefix == k.prefix && i->len == k.len &&
+			!memcmp(names.folded.data() + i->off, names.folded.data() + k.off, k.len)) {
+		found = i->idx;
+	}
+	names.folded.resize(names.folded.size() - k.len);
+	return found;
+}
+
+std::vector<uint32_t> const&
+PTFFormat::audiofiles_by_name(void) {
+	if (_wavnames.keys.size() != _audiofiles.size()) {
+		_wavnames.clear();
+		_wavnames.keys.reserve(_audiofiles.size());
+		for (uint32_t i = 0; i < _audiofiles.size(); i++) {
+			add_name(_wavnames, _audiofiles[i].filename, i);
+		}
+		sort_names(_wavnames);
+	}
+	return _wavnames.order;
+}
+
+std::vector<uint32_t> const&
+PTFFormat::regions_by_name(void) {
+	if (_regionnames.keys.size() != _regions.size()) {
+		_regionnames.clear();
+		_regionnames.keys.reserve(_regions.size());
+		for (uint32_t i = 0; i < _regions.size(); i++) {
+			add_name(_regionnames, _regions[i].name, i);
+		}
+		sort_names(_regionnames);
+	}
+	return _regionnames.order;
+}
+
+int64_t
+PTFFormat::find_audiofile(std::string const& name) {
+	audiofiles_by_name();
+	return find_name(_wavnames, name);
+}
+
+int64_t
+PTFFormat::find_region(std::string const& name) {
+	regions_by_name();
+	return find_name(_regionnames, name);
+}
+
+/* Length prefixed string at pos that ends by end, false if it does not */
+bool
+PTFFormat::parsestring (uint32_t pos, uint32_t end, std::string& s) {
+	uint32_t length;
+
+	if (!_ptfunxored || end > _len || pos > end || end - pos < 4)
+		return false;
+	length = u_endian_read4(&_ptfunxored[pos], is_bigendian);
+	if (length > end - pos - 4)
+		return false;
+	s.assign((const char *)&_ptfunxored[pos + 4], length);
+	return true;
+}
+
+/* I/O channel (0x1021) or route (0x2602): kind and format bytes, the
+ * name, then the number of channels and each channel as 2 bytes */
+bool
+PTFFormat::parse_io(block_t const& b, io_t& io) {
+	uint32_t end = b.offset + b.block_size;
+	uint32_t pos = b.offset + 4;
+	uint32_t i, n;
+
+	if (!parsestring(pos, end, io.name))
+		return false;
+	pos += 4 + io.name.size();
+	if (end - pos < 4)
+		return false;
+	n = u_endian_read4(&_ptfunxored[pos], is_bigendian);
+	pos += 4;
+	if (n > (end - pos) / 2)
+		return false;
+	io.kind = _ptfunxored[b.offset+2];
+	io.channels.resize(n);
+	for (i = 0; i < n; i++, pos += 2) {
+		io.channels[i] = u_endian_read2(&_ptfunxored[pos], is_bigendian);
+	}
 	return true;
 }
+
+void
+PTFFormat::decode_io(uint16_t list, uint16_t entry, std::vector<io_t>& out) {
+	for (vector<PTFFormat::block_t>::const_iterator b = blocks.begin();
+			b != blocks.end(); ++b) {
+		if (b->content_type != list)
+			continue;
+		for (vector<PTFFormat::block_t>::const_iterator c = b->child.begin();
+				c != b->child.end(); ++c) {
+			if (c->content_type != entry)
+				continue;
+			io_t io;
+			if (!parse_io(*c, io))
+				continue;
+			/* Routes are all output paths, their first byte
+			 * is not the kind */
+			if (entry == 0x2602)
+				io.kind = 1;
+			out.push_back(io);
+		}
+	}
+}
+
+std::vector<PTFFormat::plugin_t> const&
+PTFFormat::plugins(void) {
+	if (_plugins_done)
+		return _plugins;
+	_plugins_done = true;
+
+	for (vector<PTFFormat::block_t>::const_iterator b = blocks.begin();
+			b != blocks.end(); ++b) {
+		if (b->content_type != 0x1018)
+			continue;
+		for (vector<PTFFormat::block_t>::const_iterator c = b->child.begin();
+				c != b->child.end(); ++c) {
+			uint32_t end = c->offset + c->block_size;
+			uint32_t pos = c->offset + 3;
+			plugin_t p;
+
+			/* Name then manufacturer, product and plugin ids */
+			if (c->content_type != 0x1017 || !parsestring(pos, end, p.name))
+				continue;
+			pos += 4 + p.name.size();
+			if (end - pos < 12)
+				continue;
+			p.manufacturer = u_endian_read4(&_ptfunxored[pos], is_bigendian);
+			p.product = u_endian_read4(&_ptfunxored[pos+4], is_bigendian);
+			p.plugin = u_endian_read4(&_ptfunxored[pos+8], is_bigendian);
+			_plugins.push_back(p);
+		}
+	}
+	return _plugins;
+}
+
+std::vector<PTFFormat::io_t> const&
+PTFFormat::iochannels(void) {
+	if (!_iochannels_done) {
+		_iochannels_done = true;
+		decode_io(0x1022, 0x1021, _iochannels);
+	}
+	return _iochannels;
+}
+
+std::vector<PTFFormat::io_t> const&
+PTFFormat::routing(void) {
+	if (!_routing_done) {
+		_routing_done = true;
+		decode_io(0x2603, 0x2602, _routing);
+	}
+	return _routing;
+}
+
+/* Append the flattened elements of compound c to out.  Compounds on
+ * path are being expanded further up and are left out where they come
+ * back.  flat[c] keeps the result once state[c] is 1: set when nothing
+ * had to be left out, so that it is the same wherever c is reached
+ * from, and shared from then on.  state[c] is 2 for a result that is
+ * only right for c itself, see flatten().
+ */
+static bool
+flatten_into(std::vector<PTFFormat::compound_t> const& compounds, uint32_t c,
+		std::vector<bool>& path,
+		std::vector<std::vector<PTFFormat::compound_element_t> >& flat,
+		std::vector<uint8_t>& state,
+		std::vector<PTFFormat::compound_element_t>& out)
+{
+	std::vector<PTFFormat::compound_element_t> const& els = compounds[c].elements;
+	std::vector<PTFFormat::compound_element_t> mine;
+	bool whole = true;
+	size_t k, m, from;
+
+	if (state[c] == 1) {
+		out.insert(out.end(), flat[c].begin(), flat[c].end());
+		return true;
+	}
+
+	path[c] = true;
+	for (k = 0; k < els.size(); k++) {
+		int32_t sub = els[k].compound;
+		if (els[k].region >= 0) {
+			mine.push_back(els[k]);
+		} else if (sub >= 0 && (size_t)sub < compounds.size()) {
+			if (path[sub]) {
+				whole = false;
+				continue;
+			}
+			from = mine.size();
+			if (!flatten_into(compounds, sub, path, flat, state, mine))
+				whole = false;
+			for (m = from; m < mine.size(); m++) {
+				mine[m].start += els[k].start;
+				mine[m].end += els[k].start;
+			}
+		}
+	}
+	path[c] = false;
+
+	if (whole) {
+		flat[c] = mine;
+		state[c] = 1;
+	}
+	out.insert(out.end(), mine.begin(), mine.end());
+	return whole;
+}
+
+std::vector<PTFFormat::compound_element_t> const&
+PTFFormat::flatten(uint32_t c) {
+	static const std::vector<compound_element_t> none;
+
+	if (c >= _compounds.size())
+		return none;
+	if (_flatstate[c])
+		return _flat[c];
+
+	std::vector<bool> path (_compounds.size(), false);
+	std::vector<compound_element_t> flat;
+	if (!flatten_into(_compounds, c, path, _flat, _flatstate, flat)) {
+		_flat[c].swap(flat);
+		_flatstate[c] = 2;
+	}
+	return _flat[c];
+}
+
+std::vector<PTFFormat::compound_element_t>
+PTFFormat::flatten(std::vector<compound_t> const& compounds, uint32_t c) {
+	std::vector<std::vector<compound_element_t> > flat (compounds.size());
+	std::vector<uint8_t> state (compounds.size(), 0);
+	std::vector<bool> path (compounds.size(), false);
+	std::vector<compound_element_t> out;
+
+	if (c < compounds.size())
+		flatten_into(compounds, c, path, flat, state, out);
+	return out;
+}
+
+void
+PTFFormat::place_compound(compound_t const& c, std::vector<compound_element_t> const& flat,
+		std::vector<region_t> const& regions, track_t const& at, std::vector<track_t>& out) {
+	/* What shows of the compound, in its own time, all if no length */
+	int64_t from = c.sampleoffset;
+	int64_t to = c.sampleoffset + c.length;
+
+	for (size_t k = 0; k < flat.size(); k++) {
+		compound_element_t const& e = flat[k];
+		if (e.region < 0 || (size_t)e.region >= regions.size())
+			continue;
+		region_t const& r = regions[e.region];
+		int64_t end = e.start + r.length;
+		if (e.end > e.start && e.end < end)
+			end = e.end;
+		int64_t a = std::max(e.start, from);
+		int64_t b = c.length > 0 ? std::min(end, to) : end;
+		if (a >= b)
+			continue;
+
+		out.push_back(at);
+		track_t& t = out.back();
+		t.reg = r;
+		t.reg.startpos = at.reg.startpos + a - from;
+		t.reg.sampleoffset = r.sampleoffset + a - e.start;
+		t.reg.length = b - a;
+	}
+}
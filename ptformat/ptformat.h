@@ -24,8 +24,10 @@
 
 #include <string>
 #include <cstring>
+#include <cstdio>
 #include <algorithm>
 #include <vector>
+#include <utility>
 #include <stdint.h>
 #include "ptformat/visibility.h"
 
@@ -39,14 +41,258 @@ public:
 				-2           error detecting pt session
 				-3           incompatible pt version
 				-4           error parsing pt session
+				-5           cancelled or out of time
 	*/
 	int load(std::string const& path, int64_t targetsr);
 
+	/* Same as above, but all positions and lengths are kept in session
+	 * samples, use samples_at() to convert them to any rate.
+	 */
+	int load(std::string const& path) { return load(path, 0); }
+
+	/* Load a new revision of the session that is currently loaded,
+	 * eg. the next file of an autosave series.  Top-level blocks that
+	 * are byte-identical to the previous load are not rescanned, and
+	 * the wavs, regions and MIDI chunks they produced are reused.
+	 * Falls back to a full load() if nothing was loaded before.
+	 *
+	 * Return values:	same as load()
+	 */
+	int reload(std::string const& path, int64_t targetsr);
+
 	/* Return values:	0            success
 				-1           error decrypting pt session
 	*/
 	int unxor(std::string const& path);
 
+	class Source;
+	int unxor(Source& src);
+
+	/* Decrypt a session read from in and write it to out, in fixed
+	 * size chunks through one buffer, so that memory use does not
+	 * depend on the session size.  Works on pipes.
+	 *
+	 * Return values:	0            success
+				-1           error decrypting pt session
+				-2           error writing
+	*/
+	static int unxor_stream(FILE *in, FILE *out);
+
+	/* Load phases, in order */
+	enum phase_t {
+		PhaseDecrypt,		// done/total are bytes
+		PhaseBlocks,		// done/total are top-level blocks,
+					// bytes in a pipelined load
+		PhaseAudio,
+		PhaseRegions,
+		PhaseTracks,
+		PhaseMidi
+	};
+
+	/* Called from within load() (and so from the worker thread of
+	 * load_async()), return false to cancel the load.
+	 */
+	class Progress {
+	public:
+		virtual ~Progress () {}
+		virtual bool progress (phase_t phase, uint64_t done, uint64_t total) = 0;
+	};
+
+	void set_progress (Progress* p) { _progress = p; }
+
+	/* Limit a load to ms milliseconds, 0 for no limit.  Running out of
+	 * time before the audio tracks are parsed cancels the load, after
+	 * that MIDI is skipped and partial() returns true.
+	 */
+	void set_time_budget (uint32_t ms) { _budget_ms = ms; }
+	bool partial () const { return _partial; }
+
+	/* Threads load() may use, 1 (the default) for the calling thread
+	 * only.  With more, the subtrees of the top-level blocks of large
+	 * sessions are scanned by up to n threads, and the MIDI events are
+	 * read while the audio, regions and tracks are parsed (except in
+	 * loads with a Visitor or a time budget).  The results are the
+	 * same either way.
+	 */
+	void set_jobs (uint32_t n) { _jobs = n ? n : 1; }
+
+	/* Only scan subtrees on more threads when the top-level blocks to
+	 * scan hold at least this many bytes, 256 KiB by default.  Smaller
+	 * sessions are quicker scanned than threads are started.  0 always
+	 * uses the threads, eg. to test them on small sessions.
+	 */
+	void set_parallel_bytes (uint64_t bytes) { _parallel_bytes = bytes; }
+
+	/* Decrypt on a thread of its own while load() lays out and scans
+	 * each top-level block as soon as it is decrypted, so that reading
+	 * and decrypting overlap with the block scan.  Subtrees are then
+	 * all scanned by the loading thread, whatever set_jobs().
+	 */
+	void set_pipelined (bool yes) { _pipelined = yes; }
+
+	/* Run load() on a worker thread, returns -1 if it cannot be started.
+	 * Nothing but cancel() may be called until wait() returned.
+	 */
+	int load_async (std::string const& path, int64_t targetsr);
+
+	/* Wait for load_async() to finish and return the result of load() */
+	int wait (void);
+
+	/* Stop a running load at the next check, it returns -5 */
+	void cancel (void) { _cancel = true; }
+
+	struct wav_t;
+	struct midi_ev_t;
+	struct region_t;
+	struct track_t;
+
+	/* Receives sources, regions, placements and MIDI events while they
+	 * are parsed, see load() below.  Override the calls of interest.
+	 * MIDI events arrive per chunk before MIDI regions are built, the
+	 * notes of a MIDI region are all events of the chunk passed with it.
+	 */
+	class Visitor {
+	public:
+		virtual ~Visitor () {}
+		virtual void on_wav (wav_t const&) {}
+		virtual void on_region (region_t const&) {}
+		virtual void on_track_placement (track_t const&) {}
+		virtual void on_midi_event (uint32_t /* chunk */, midi_ev_t const&) {}
+		virtual void on_midi_region (uint32_t /* chunk */, region_t const&) {}
+		virtual void on_midi_track_placement (track_t const&) {}
+	};
+
+	/* As load(path, targetsr), also passing everything to v as it is
+	 * parsed.  Unless keep is set, MIDI events are not stored on the
+	 * regions and the results and block tree are released before
+	 * returning, so that audiofiles() etc. are empty afterwards.
+	 */
+	int load(std::string const& path, int64_t targetsr, Visitor& v, bool keep = false);
+
+	/* Where a session is read from: its size, then reads at any
+	 * position, mostly in order.  read() returns the number of bytes
+	 * read, which may be fewer than n, 0 at the end and -1 on error.
+	 * Implement it to load from storage other than local files.
+	 */
+	class Source {
+	public:
+		virtual ~Source () {}
+		virtual int64_t size () = 0;		// -1 on error
+		virtual int64_t read (uint64_t pos, void* buf, uint64_t n) = 0;
+		virtual std::string name () const { return ""; }
+	};
+
+	/* The file at path */
+	class LIBPTFORMAT_API FileSource : public Source {
+	public:
+		FileSource (std::string const& path);
+		~FileSource ();
+		int64_t size ();
+		int64_t read (uint64_t pos, void* buf, uint64_t n);
+		std::string name () const { return _path; }
+	private:
+		FileSource (FileSource const&);
+		FileSource& operator= (FileSource const&);
+		std::string _path;
+		FILE*       _fp;
+		int64_t     _pos;		// of _fp, -1 if not known
+	};
+
+	/* len bytes at data, which must outlive the source */
+	class LIBPTFORMAT_API MemorySource : public Source {
+	public:
+		MemorySource (const void* data, uint64_t len, std::string const& name = "")
+			: _data ((const unsigned char*) data), _len (len), _name (name) {}
+		int64_t size () { return _len; }
+		int64_t read (uint64_t pos, void* buf, uint64_t n);
+		std::string name () const { return _name; }
+	private:
+		const unsigned char* _data;
+		uint64_t             _len;
+		std::string          _name;
+	};
+
+	/* An open file descriptor, read with pread() and left open */
+	class LIBPTFORMAT_API FdSource : public Source {
+	public:
+		FdSource (int fd, std::string const& name = "") : _fd (fd), _name (name) {}
+		int64_t size ();
+		int64_t read (uint64_t pos, void* buf, uint64_t n);
+		std::string name () const { return _name; }
+	private:
+		int         _fd;
+		std::string _name;
+	};
+
+	/* Reads src only in whole blocks at block aligned offsets, into
+	 * page aligned buffers, and reads the next block on a thread while
+	 * the current one is used.  For storage with a high cost per read.
+	 * blocksize is rounded up to 4 KiB, 0 for 1 MiB.  src must outlive
+	 * it.
+	 */
+	class LIBPTFORMAT_API ReadAheadSource : public Source {
+	public:
+		ReadAheadSource (Source& src, uint32_t blocksize = 0);
+		~ReadAheadSource ();
+		int64_t size ();
+		int64_t read (uint64_t pos, void* buf, uint64_t n);
+		std::string name () const { return _src.name(); }
+	private:
+		ReadAheadSource (ReadAheadSource const&);
+		ReadAheadSource& operator= (ReadAheadSource const&);
+		struct fetch_t;
+		static void* fetch_job (void* arg);
+		int64_t fill (unsigned char* buf, uint64_t block);
+		void start (fetch_t* f, uint64_t block);
+		void finish (fetch_t* f);
+		Source&  _src;
+		uint32_t _blocksize;
+		int64_t  _size;
+		fetch_t* _fetch;		// the block read() copies from
+		fetch_t* _ahead;		// the next, maybe still being read
+	};
+
+	/* A file inside the zip, tar or .tar.gz archive read from src,
+	 * decompressed as it is read, member "" for the first that looks
+	 * like a session (not a backup or a macOS resource fork).  Stored
+	 * zip members and plain tar always work, deflated zip members and
+	 * .tar.gz need HAVE_ZLIB.  size() is -1 if the member cannot be
+	 * read.  src must outlive it.
+	 */
+	class LIBPTFORMAT_API ArchiveSource : public Source {
+	public:
+		ArchiveSource (Source& src, std::string const& member = "");
+		~ArchiveSource ();
+		int64_t size () { return _size; }
+		int64_t read (uint64_t pos, void* buf, uint64_t n);
+		std::string name () const { return _src.name() + "/" + _member; }
+		bool archive () const { return _archive; }	// src is zip, tar or gzip
+		std::string const& member () const { return _member; }
+	private:
+		ArchiveSource (ArchiveSource const&);
+		ArchiveSource& operator= (ArchiveSource const&);
+		struct inflate_t;
+		bool find_zip (std::string const& member);
+		bool find_tar (std::string const& member);
+		int64_t read_stream (uint64_t pos, void* buf, uint64_t n);
+		int64_t inflate_some (void* buf, uint64_t n);
+		bool read_all (uint64_t pos, void* buf, uint64_t n);
+		Source&     _src;
+		std::string _member;
+		bool        _archive;
+		int         _codec;		// of the stream holding the member:
+						// 0 stored, 1 deflate, 2 gzip
+		uint64_t    _start;		// of the stream in src
+		uint64_t    _length;		// of the stream in src
+		uint64_t    _offset;		// of the member in the stream
+		int64_t     _size;
+		inflate_t*  _z;
+	};
+
+	/* As load(path, targetsr), reading the session from src, path()
+	 * is then src.name() */
+	int load(Source& src, int64_t targetsr);
+
 	struct wav_t {
 		std::string filename;
 		uint16_t    index;
@@ -206,9 +452,167 @@ public:
 		return false;
 	}
 
+	/* Optional index for time range queries over track placements.
+	 * Build it with index_placements() after load(), every query is
+	 * then O(log n + k).  Results are indices into tracks() or, with
+	 * midi set, miditracks(), in order of start position.  The next
+	 * load() drops the index.
+	 */
+	struct range_t {
+		uint16_t track;
+		int64_t  start;
+		int64_t  end;
+		range_t (uint16_t t = 0, int64_t s = 0, int64_t e = 0) : track (t), start (s), end (e) {}
+	};
+
+	void index_placements (void);
+
+	/* Placements on track that overlap [start, end) */
+	void placements_in (uint16_t track, int64_t start, int64_t end,
+			std::vector<uint32_t>& out, bool midi = false) const;
+
+	/* Placements on track that contain pos */
+	void placements_at (uint16_t track, int64_t pos,
+			std::vector<uint32_t>& out, bool midi = false) const {
+		placements_in (track, pos, pos + 1, out, midi);
+	}
+
+	/* One result vector per query */
+	void placements_in (std::vector<range_t> const& queries,
+			std::vector<std::vector<uint32_t> >& out, bool midi = false) const;
+
+	/* Audio files and regions in name order ignoring case, the order
+	 * of wav_t and region_t operator<, as indices into audiofiles()
+	 * and regions().  Built on first use from precomputed case folded
+	 * keys and kept until the next load().
+	 */
+	std::vector<uint32_t> const& audiofiles_by_name (void);
+	std::vector<uint32_t> const& regions_by_name (void);
+
+	/* Index into audiofiles() or regions() of the first entry named
+	 * name ignoring case, or -1 */
+	int64_t find_audiofile (std::string const& name);
+	int64_t find_region (std::string const& name);
+
+	/* Plugins and I/O, decoded from the block tree the first time each
+	 * is asked for and kept until the next load(), so they cost load()
+	 * nothing.  Empty after a load() with a Visitor that does not keep
+	 * its results.
+	 */
+	struct plugin_t {
+		std::string name;
+		uint32_t manufacturer;		// four character codes
+		uint32_t product;
+		uint32_t plugin;
+		plugin_t () : manufacturer (0), product (0), plugin (0) {}
+	};
+
+	struct io_t {
+		std::string name;
+		uint8_t kind;			// 0 input, 1 output, 2 bus,
+						// 3 hardware insert
+		std::vector<uint16_t> channels;	// hardware channels from 1
+		io_t () : kind (0) {}
+	};
+
+	std::vector<plugin_t> const& plugins (void);
+	/* Inputs, outputs and busses of the I/O setup */
+	std::vector<io_t> const& iochannels (void);
+	/* Output paths and their sub paths, all of kind 1 */
+	std::vector<io_t> const& routing (void);
+
+	/* Compound regions (PT10 and later): the groups (0x2628) of the
+	 * full map (0x262c) that have elements (0x2523).  Each element
+	 * refers to another compound or to a region of regions() by index,
+	 * member regions are never copied.  Element start and end are
+	 * relative to the start of the compound, in the same samples as
+	 * startpos (converted like MIDI placements, which are stored the
+	 * same way).
+	 */
+	struct compound_element_t {
+		uint32_t ref;		// region number as stored
+		int32_t  region;	// index into regions(), or -1
+		int32_t  compound;	// index into compounds(), or -1
+		int64_t  start;
+		int64_t  end;
+		compound_element_t () : ref (0), region (-1), compound (-1), start (0), end (0) {}
+	};
+
+	struct compound_t {
+		std::string name;
+		uint16_t    index;	// the number elements refer to it by
+		int64_t     startpos;
+		int64_t     sampleoffset;
+		int64_t     length;
+		std::vector<compound_element_t> elements;
+		compound_t () : index (0), startpos (0), sampleoffset (0), length (0) {}
+	};
+
+	const std::vector<compound_t>& compounds () const { return _compounds; }
+
+	/* The regions compound c (an index into compounds()) is made of,
+	 * with nested compounds expanded and their elements moved by the
+	 * start of the element they are in.  Worked out on first request,
+	 * sharing the results for nested compounds, and kept until the
+	 * next load().  Unresolved elements are left out, and so is an
+	 * element that leads back to a compound it is already inside of
+	 * on the way down from c.  That cuts every cycle at the same place
+	 * for a given c, whatever was flattened before.
+	 */
+	std::vector<compound_element_t> const& flatten (uint32_t c);
+
+	/* As above, for compound c of any list, eg. one built by hand */
+	static std::vector<compound_element_t> flatten (std::vector<compound_t> const& compounds, uint32_t c);
+
+	/* Append to out the placements of compound c placed as at (its
+	 * track and at.reg.startpos), flat being flatten(c): one for each
+	 * region that shows between the sampleoffset and length of c,
+	 * trimmed to what shows.  load() places compounds on audio tracks
+	 * this way, so that tracks() lists the regions they are made of.
+	 */
+	static void place_compound (compound_t const& c, std::vector<compound_element_t> const& flat,
+			std::vector<region_t> const& regions, track_t const& at, std::vector<track_t>& out);
+
+	/* A block of the session: a 7 byte header ('Z', block type and
+	 * size) then block_size bytes starting at offset, the first two
+	 * of which are the content type, with any child blocks inside.
+	 */
+	struct block_t {
+		uint8_t zmark;			// 'Z'
+		uint16_t block_type;		// type of block
+		uint32_t block_size;		// size of block
+		uint16_t content_type;		// type of content
+		uint32_t offset;		// offset in file
+		std::vector<block_t> child;	// vector of child blocks
+	};
+
+	/* Decrypt the session and parse its block tree only, for looking
+	 * into sessions, including versions load() does not support.
+	 * Return values as for load(), minus -3 and -4.
+	 */
+	int load_blocks (std::string const& path);
+	std::vector<block_t> const& blocktree () const { return blocks; }
+
+	/* What a content type is known to hold, or NULL */
+	struct content_desc_t {
+		uint16_t    content_type;
+		const char *description;
+	};
+	static const char* content_description (uint16_t ctype);
+	/* All n known content types, in content type order */
+	static const content_desc_t* content_descriptions (uint32_t& n);
+
 	uint8_t version () const { return _version; }
 	int64_t sessionrate () const { return _sessionrate ; }
-	const std::string& path () { return _path; }
+	int64_t targetrate () const { return _targetrate ; }
+
+	/* Convert a position or length in session samples (as produced by
+	 * load(path)) to samples at rate, exactly, rounding towards zero.
+	 */
+	int64_t samples_at (int64_t samples, int64_t rate) const {
+		return rescale (samples, _sessionrate, rate);
+	}
+	const std::string& path () const { return _path; }
 
 	const std::vector<wav_t>&    audiofiles () const { return _audiofiles ; }
 	const std::vector<region_t>& regions () const { return _regions ; }
@@ -216,10 +620,102 @@ public:
 	const std::vector<track_t>&  tracks () const { return _tracks ; }
 	const std::vector<track_t>&  miditracks () const { return _miditracks ; }
 
+	class Snapshot;
+
+	/* Counted handle to a Snapshot.  Copying and destroying handles
+	 * is O(1) and safe from any thread, the snapshot is freed with its
+	 * last handle.
+	 */
+	class LIBPTFORMAT_API SnapshotRef {
+	public:
+		SnapshotRef () : _s (NULL) {}
+		SnapshotRef (SnapshotRef const& other);
+		~SnapshotRef ();
+		SnapshotRef& operator= (SnapshotRef const& other);
+
+		Snapshot const* get () const { return _s; }
+		Snapshot const* operator-> () const { return _s; }
+		Snapshot const& operator* () const { return *_s; }
+		bool empty () const { return _s == NULL; }
+
+	private:
+		friend class PTFFormat;
+		explicit SnapshotRef (Snapshot* s) : _s (s) {}	// adopts the first count
+		Snapshot* _s;
+	};
+
+	/* The model parsed by one load(), never changed once made, so any
+	 * number of threads can query one snapshot without locking.
+	 * Lookups return pointers into it, or NULL, instead of copies.
+	 */
+	class LIBPTFORMAT_API Snapshot {
+	public:
+		const std::string& path () const { return _path; }
+		uint8_t version () const { return _version; }
+		int64_t sessionrate () const { return _sessionrate; }
+		int64_t targetrate () const { return _targetrate; }
+		bool partial () const { return _partial; }
+		int64_t samples_at (int64_t samples, int64_t rate) const {
+			return rescale (samples, _sessionrate, rate);
+		}
+
+		const std::vector<wav_t>&      audiofiles () const { return _audiofiles; }
+		const std::vector<region_t>&   regions () const { return _regions; }
+		const std::vector<region_t>&   midiregions () const { return _midiregions; }
+		const std::vector<track_t>&    tracks () const { return _tracks; }
+		const std::vector<track_t>&    miditracks () const { return _miditracks; }
+		const std::vector<compound_t>& compounds () const { return _compounds; }
+
+		const track_t*  find_track (uint16_t index) const;
+		const region_t* find_region (uint16_t index) const;
+		const track_t*  find_miditrack (uint16_t index) const;
+		const region_t* find_midiregion (uint16_t index) const;
+		const wav_t*    find_wav (uint16_t index) const;
+
+	private:
+		friend class PTFFormat;
+		friend class SnapshotRef;
+		Snapshot () : _refs (1), _version (0), _sessionrate (0), _targetrate (0), _partial (false) {}
+		Snapshot (Snapshot const&);
+		Snapshot& operator= (Snapshot const&);
+
+		mutable int _refs;
+		std::string _path;
+		uint8_t     _version;
+		int64_t     _sessionrate;
+		int64_t     _targetrate;
+		bool        _partial;
+		std::vector<wav_t>      _audiofiles;
+		std::vector<region_t>   _regions;
+		std::vector<region_t>   _midiregions;
+		std::vector<track_t>    _tracks;
+		std::vector<track_t>    _miditracks;
+		std::vector<compound_t> _compounds;
+	};
+
+	/* A snapshot of the model as loaded now, copied so that this
+	 * PTFFormat, reload() included, works on as before.  Empty handle
+	 * if nothing is loaded.
+	 */
+	SnapshotRef snapshot (void) const;
+
+	/* As load(path, targetsr), then move the model into a new
+	 * snapshot in out without copying it.  Everything is released
+	 * from this PTFFormat as by load() with a Visitor, so it is ready
+	 * for the next load().  out is empty unless 0 is returned.
+	 */
+	int load(std::string const& path, int64_t targetsr, SnapshotRef& out);
+
+	/* Content type and hash of every top-level block, in file order.
+	 * Blocks with identical content hash the same in any session.
+	 */
+	void blockhashes (std::vector<std::pair<uint16_t, uint64_t> >& out);
+
 	const unsigned char* unxored_data () const { return _ptfunxored; }
 	uint64_t             unxored_size () const { return _len; }
 
 private:
+	friend class Snapshot;
 
 	std::vector<wav_t>    _audiofiles;
 	std::vector<region_t> _regions;
@@ -238,40 +734,222 @@ private:
 	float          _ratefactor;
 	bool           is_bigendian;
 
-	struct block_t {
-		uint8_t zmark;			// 'Z'
-		uint16_t block_type;		// type of block
-		uint32_t block_size;		// size of block
-		uint16_t content_type;		// type of content
-		uint32_t offset;		// offset in file
-		std::vector<block_t> child;	// vector of child blocks
-	};
 	std::vector<block_t> blocks;
+	std::vector<uint64_t> _blockhash;	// per top-level block, see reload()
+
+	/* What the single pass over the top-level blocks leaves for the
+	 * fix-up passes: the blocks that refer to results of other
+	 * blocks, in file order, and the wav lengths of each 0x1004 */
+	struct scan_t {
+		bool     audio;		// parse rather than reuse these
+		bool     regions;
+		bool     midichunks;
+		bool     wavsfound;
+		bool     regionsfound;
+		uint32_t nwavs;		// of the last 0x1004
+		std::vector<std::vector<uint64_t> > wavlengths;
+		std::vector<const block_t*> miditracks;		// 0x2519
+		std::vector<const block_t*> placements;		// 0x1012, 0x1054
+		std::vector<const block_t*> chunks;		// 0x2000
+		std::vector<const block_t*> midiregions;	// 0x2002, 0x2634
+		std::vector<const block_t*> compound;		// 0x262c
+		std::vector<const block_t*> midiplacements;	// 0x1058
+	};
+	scan_t _scan;
+
+	/* Top-level content type to what the single pass does with it:
+	 * parse it on the spot with fn, or keep it in list for later */
+	typedef void (PTFFormat::*scan_fn)(block_t const& b);
+	struct dispatch_t {
+		uint16_t content_type;
+		scan_fn  fn;
+		std::vector<const block_t*> scan_t::*list;
+	};
+	static const dispatch_t scan_table[];
+	static const content_desc_t content_types[];
+
+	struct mchunk {
+		mchunk (uint64_t zt, uint64_t ml, std::vector<midi_ev_t> const& c)
+		: zero (zt)
+		, maxlen (ml)
+		, chunk (c)
+		{}
+		uint64_t zero;
+		uint64_t maxlen;
+		std::vector<midi_ev_t> chunk;
+	};
+	std::vector<mchunk> _midichunks;
+
+	/* Placements of one track sorted by start, maxend is the largest
+	 * end in the implicit binary tree below each element */
+	struct span_t {
+		int64_t  start;
+		int64_t  end;
+		int64_t  maxend;
+		uint32_t idx;
+		bool operator <(const span_t& other) const {
+			return start < other.start;
+		}
+	};
+	typedef std::vector<std::vector<span_t> > span_index_t;
+	span_index_t _trackspans;
+	span_index_t _miditrackspans;
+
+	/* Sort key of a name: its first 8 case folded bytes packed big
+	 * endian, so that most comparisons are one integer compare, and
+	 * where the rest of the folded name is in name_index_t::folded */
+	struct namekey_t {
+		uint64_t prefix;
+		uint32_t off;
+		uint32_t len;
+		uint32_t idx;
+	};
+	struct name_index_t {
+		std::string            folded;
+		std::vector<namekey_t> keys;
+		std::vector<uint32_t>  order;
+		void clear () { folded.clear(); keys.clear(); order.clear(); }
+	};
+	/* Orders keys like strcasecmp orders their names, ties by index */
+	struct namekey_less {
+		const char *folded;
+		namekey_less (const char *f) : folded (f) {}
+		bool operator ()(const namekey_t& a, const namekey_t& b) const {
+			if (a.prefix != b.prefix)
+				return a.prefix < b.prefix;
+			/* Equal prefixes mean equal first 8 bytes */
+			uint32_t n = std::min(a.len, b.len);
+			int c = n > 8 ? memcmp(folded + a.off + 8, folded + b.off + 8, n - 8) : 0;
+			if (c)
+				return c < 0;
+			if (a.len != b.len)
+				return a.len < b.len;
+			return a.idx < b.idx;
+		}
+	};
+	name_index_t _wavnames;
+	name_index_t _regionnames;
+
+	std::vector<plugin_t> _plugins;
+	std::vector<io_t>     _iochannels;
+	std::vector<io_t>     _routing;
+	bool _plugins_done;
+	bool _iochannels_done;
+	bool _routing_done;
+
+	std::vector<compound_t> _compounds;
+	std::vector<std::vector<compound_element_t> > _flat;
+	std::vector<uint8_t> _flatstate;	// per compound, see flatten_into()
+
+	/* State of the previous load, only valid during reload() */
+	struct prev_session_t {
+		std::vector<block_t>  blocks;
+		std::vector<uint64_t> blockhash;
+		std::vector<wav_t>    audiofiles;
+		std::vector<region_t> regions;
+		std::vector<mchunk>   midichunks;
+		int64_t               sessionrate;
+		int64_t               targetrate;
+		uint8_t               version;
+		bool                  bigendian;
+	};
+	prev_session_t* _prev;
+
+	Visitor* _visitor;		// only set during load() with a visitor
+	bool     _keep_events;
+
+	Progress*     _progress;
+	uint32_t      _jobs;
+	uint64_t      _parallel_bytes;
+	bool          _pipelined;
+	struct pipe_t;
+	pipe_t*       _pipe;		// only set during a pipelined load
+	bool          _decrypted;	// a pipelined load decrypted it all
+	uint32_t      _budget_ms;
+	uint64_t      _start_ms;
+	bool          _partial;
+	volatile bool _cancel;
+
+	struct async_t;
+	async_t* _async;
+	static void* async_load(void* arg);
+	int load_session(std::string const& path, int64_t targetsr);
+	int load_source(Source& src, std::string const& path, int64_t targetsr);
+	bool progress(phase_t phase, uint64_t done, uint64_t total);
+	bool out_of_time(void);
 
-	bool jumpback(uint32_t *currpos, unsigned char *buf, const uint32_t maxoffset, const unsigned char *needle, const uint32_t needlelen);
 	bool jumpto(uint32_t *currpos, unsigned char *buf, const uint32_t maxoffset, const unsigned char *needle, const uint32_t needlelen);
 	bool foundin(std::string const& haystack, std::string const& needle);
+	bool foundin(const char *haystack, uint32_t n, const char *needle, uint32_t needlelen);
 	int64_t foundat(unsigned char *haystack, uint64_t n, const char *needle);
 
 	std::string parsestring(uint32_t pos);
+	bool parsestring(uint32_t pos, uint32_t end, std::string& s);
+	bool parse_io(block_t const& b, io_t& io);
+	void decode_io(uint16_t list, uint16_t entry, std::vector<io_t>& out);
+	uint32_t stringlen(uint32_t pos);
 	const std::string get_content_description(uint16_t ctype);
 	int parse(void);
 	void parseblocks(void);
+	template <bool bigendian> void parseblocks(void);
 	bool parseheader(void);
+	void scanblocks(void);
+	void scan_audio(block_t const& b);
+	void scan_regions(block_t const& b);
+	void scan_tracks(block_t const& b);
 	bool parserest(void);
+	void parseregions(void);
+	void parsecompounds(void);
+	int32_t find_compound(uint32_t number) const;
 	bool parseaudio(void);
 	bool parsemidi(void);
+	void parsemidichunks(void);
+	template <bool bigendian> void parsemidichunks(void);
+	static void* midichunks_job(void* arg);
+	bool unxor_open(Source& src, uint8_t& xor_type, unsigned char *xxor);
+	int unxor_start(Source& src);
+	bool unxor_finish(void);
+	uint64_t wait_decrypted(uint64_t end);
+	static void* decrypt_job(void* arg);
+	template <bool bigendian> void parseblocks_pipelined(void);
+	int parsetracks(void);
 	void dump(void);
 	bool parse_block_at(uint32_t pos, struct block_t *b, struct block_t *parent, int level);
+	template <bool bigendian> bool parse_block_at(uint32_t pos, struct block_t *b, struct block_t *parent, int level);
+	template <bool bigendian> bool parse_block_header(uint32_t pos, struct block_t *b, uint32_t max);
+	template <bool bigendian> void parse_block_children(struct block_t *b, uint32_t max, int level);
+	struct blockjob_t;
+	struct larger_block;
+	template <bool bigendian> static void* blocks_job(void* arg);
+	template <bool bigendian> void scan_subtrees(blockjob_t& job, bool report);
 	void dump_block(struct block_t& b, int level);
 	bool parse_version();
-	void parse_region_info(uint32_t j, block_t& blk, region_t& r);
+	void parse_region_info(uint32_t j, block_t const& blk, region_t& r);
 	void parse_three_point(uint32_t j, uint64_t& start, uint64_t& offset, uint64_t& length);
-	uint8_t gen_xor_delta(uint8_t xor_value, uint8_t mul, bool negative);
+	template <bool bigendian> void parse_three_point(uint32_t j, uint64_t& start, uint64_t& offset, uint64_t& length);
+	static uint8_t gen_xor_delta(uint8_t xor_value, uint8_t mul, bool negative);
+	static bool gen_xor_key(const unsigned char *header, uint8_t& xor_type, unsigned char *xxor);
 	void setrates(void);
 	void cleanup(void);
-	void free_block(struct block_t& b);
+	void release(void);
+	static int64_t rescale(int64_t samples, int64_t from, int64_t to) {
+		if (from == 0 || to == from) {
+			return samples;
+		}
+		return (samples / from) * to + (samples % from) * to / from;
+	}
 	void free_all_blocks(void);
+	uint64_t hash_block(struct block_t& b);
+	void hash_all_blocks(void);
+	void shift_block(struct block_t& b, int64_t delta);
+	bool unchanged_since_prev(const uint16_t *ctypes, int n);
+	static void add_name(name_index_t& names, std::string const& name, uint32_t idx);
+	static void sort_names(name_index_t& names);
+	static int64_t find_name(name_index_t& names, std::string const& name);
+	static void index_spans(std::vector<track_t> const& tracks, span_index_t& index);
+	static int64_t index_maxend(std::vector<span_t>& spans, uint32_t lo, uint32_t hi);
+	static void query_spans(std::vector<span_t> const& spans, uint32_t lo, uint32_t hi,
+			int64_t start, int64_t end, std::vector<uint32_t>& out);
 };
 
 #endif
@@ -0,0 +1,172 @@
+/*
+ * libptformat - a library to read ProTools sessions
+ *
+ * Copyright (C) 2015  Damien Zammit
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+#ifndef PTFREPORT_H
+#define PTFREPORT_H
+
+/* The report that ptftool prints and the EXPECT sections of tests/
+ * hold, shared by ptftool and ptcheck so that they cannot drift apart.
+ */
+
+#include "ptformat/ptformat.h"
+#include <inttypes.h> // PRIxyy
+#include <cstdarg>
+#include <cstdio>
+#include <stdlib.h>
+#include <string>
+
+static void
+report_add(std::string& s, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+static void
+report_add(std::string& s, const char *fmt, ...)
+{
+	char buf[1024];
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+	if (n < 0)
+		return;
+	if ((size_t)n < sizeof(buf)) {
+		s += buf;
+		return;
+	}
+
+	/* Long names */
+	char *big = (char *) malloc(n + 1);
+	if (!big)
+		return;
+	va_start(ap, fmt);
+	vsnprintf(big, n + 1, fmt, ap);
+	va_end(ap);
+	s += big;
+	free(big);
+}
+
+/* The results of ptf.load(path, targetsr), which returned ok */
+static std::string
+ptf_report(PTFFormat& ptf, int ok, int64_t targetsr)
+{
+	std::string s;
+
+	switch (ok) {
+	default:
+	case -1:
+		return "Cannot decrypt ptf, quit\n";
+	case -2:
+		return "Cannot extract version from ptf, quit\n";
+	case -3:
+		return "Unsupported ptf version, quit\n";
+	case -4:
+		return "Cannot parse ptf, quit\n";
+	case 0:
+		break;
+	}
+
+	report_add(s, "ProTools %d Session: Samplerate = %" PRId64 "Hz\nTarget samplerate = %" PRId64 "\n\n",
+		ptf.version(), ptf.sessionrate(), targetsr);
+	report_add(s, "%zu wavs, %zu regions, %zu active regions\n\n",
+		ptf.audiofiles().size(),
+		ptf.regions().size(),
+		ptf.tracks().size());
+
+	report_add(s, "Audio file (WAV#) @ offset, length:\n");
+	for (std::vector<PTFFormat::wav_t>::const_iterator
+			a = ptf.audiofiles().begin();
+			a != ptf.audiofiles().end(); ++a) {
+		report_add(s, "`%s` w(%d) @ %" PRIu64 ", %" PRIu64 "\n",
+			a->filename.c_str(),
+			a->index,
+			a->posabsolute,
+			a->length);
+	}
+
+	report_add(s, "\nRegion (Region#) (WAV#) @ into-sample, length:\n");
+	for (std::vector<PTFFormat::region_t>::const_iterator
+			a = ptf.regions().begin();
+			a != ptf.regions().end(); ++a) {
+		report_add(s, "`%s` r(%d) w(%d) @ %" PRIu64 ", %" PRIu64 "\n",
+			a->name.c_str(),
+			a->index,
+			a->wave.index,
+			a->sampleoffset,
+			a->length);
+	}
+
+	report_add(s, "\nMIDI Region (Region#) @ into-sample, length:\n");
+	for (std::vector<PTFFormat::region_t>::const_iterator
+			a = ptf.midiregions().begin();
+			a != ptf.midiregions().end(); ++a) {
+		report_add(s, "`%s` r(%d) @ %" PRIu64 ", %" PRIu64 "\n",
+			a->name.c_str(),
+			a->index,
+			a->sampleoffset,
+			a->length);
+		for (std::vector<PTFFormat::midi_ev_t>::const_iterator
+				b = a->midi.begin();
+				b != a->midi.end(); ++b) {
+			report_add(s, "    MIDI: n(%d) v(%d) @ %" PRIu64 ", %" PRIu64 "\n",
+				b->note, b->velocity,
+				b->pos, b->length);
+		}
+	}
+
+	report_add(s, "\nTrack name (Track#) (Region#) @ Absolute:\n");
+	for (std::vector<PTFFormat::track_t>::const_iterator
+			a = ptf.tracks().begin();
+			a != ptf.tracks().end(); ++a) {
+		report_add(s, "`%s` t(%d) r(%d) @ %" PRIu64 "\n",
+			a->name.c_str(),
+			a->index,
+			a->reg.index,
+			a->reg.startpos);
+	}
+
+	report_add(s, "\nMIDI Track name (MIDITrack#) (MIDIRegion#) @ Absolute:\n");
+	for (std::vector<PTFFormat::track_t>::const_iterator
+			a = ptf.miditracks().begin();
+			a != ptf.miditracks().end(); ++a) {
+		report_add(s, "`%s` mt(%d) mr(%d) @ %" PRIu64 "\n",
+			a->name.c_str(),
+			a->index,
+			a->reg.index,
+			a->reg.startpos);
+	}
+
+	report_add(s, "\nTrack name (Track#) (WAV filename) @ Absolute + Into-sample, Length:\n");
+	for (std::vector<PTFFormat::track_t>::const_iterator
+			a = ptf.tracks().begin();
+			a != ptf.tracks().end(); ++a) {
+		report_add(s, "`%s` t(%d) (%s) @ %" PRIu64 " + %" PRIu64 ", %" PRIu64 "\n",
+			a->name.c_str(),
+			a->index,
+			a->reg.wave.filename.c_str(),
+			a->reg.startpos,
+			a->reg.sampleoffset,
+			a->reg.length
+			);
+	}
+	return s;
+}
+
+#endif
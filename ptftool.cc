@@ -20,7 +20,7 @@
  */
 
 #include "ptformat/ptformat.h"
-#include <inttypes.h> // PRIxyy
+#include "ptfreport.h"
 #include <cstdio>
 #include <stdlib.h>
 
@@ -36,110 +36,17 @@ int main (int argc, char **argv) {
 		exit(0);
 	}
 
-	ok = ptf.load(argv[1], 48000);
+	/* Sessions inside zip or tar archives are read in place,
+	 * optionally naming the member as the second argument */
+	PTFFormat::FileSource file (argv[1]);
+	PTFFormat::ArchiveSource archive (file, argc > 2 ? argv[2] : "");
 
-	switch (ok) {
-	default:
-	case -1:
-		printf("Cannot decrypt ptf, quit\n");
-		exit(-1);
-		break;
-	case -2:
-		printf("Cannot extract version from ptf, quit\n");
-		exit(-1);
-		break;
-	case -3:
-		printf("Unsupported ptf version, quit\n");
-		exit(-1);
-		break;
-	case -4:
-		printf("Cannot parse ptf, quit\n");
-		exit(-1);
-		break;
-	case 0:
-		printf("ProTools %d Session: Samplerate = %" PRId64 "Hz\nTarget samplerate = 48000\n\n", ptf.version(), ptf.sessionrate());
-		printf("%zu wavs, %zu regions, %zu active regions\n\n",
-			ptf.audiofiles().size(),
-			ptf.regions().size(),
-			ptf.tracks().size()
-			);
-		printf("Audio file (WAV#) @ offset, length:\n");
-		for (vector<PTFFormat::wav_t>::const_iterator
-				a = ptf.audiofiles().begin();
-				a != ptf.audiofiles().end(); ++a) {
-			printf("`%s` w(%d) @ %" PRIu64 ", %" PRIu64 "\n",
-				a->filename.c_str(),
-				a->index,
-				a->posabsolute,
-				a->length);
-		}
-
-		printf("\nRegion (Region#) (WAV#) @ into-sample, length:\n");
-		for (vector<PTFFormat::region_t>::const_iterator
-				a = ptf.regions().begin();
-				a != ptf.regions().end(); ++a) {
-			printf("`%s` r(%d) w(%d) @ %" PRIu64 ", %" PRIu64 "\n",
-				a->name.c_str(),
-				a->index,
-				a->wave.index,
-				a->sampleoffset,
-				a->length);
-		}
-
-		printf("\nMIDI Region (Region#) @ into-sample, length:\n");
-		for (vector<PTFFormat::region_t>::const_iterator
-			a = ptf.midiregions().begin();
-			a != ptf.midiregions().end(); ++a) {
-			printf("`%s` r(%d) @ %" PRIu64 ", %" PRIu64 "\n",
-				a->name.c_str(),
-				a->index,
-				a->sampleoffset,
-				a->length);
-			for (vector<PTFFormat::midi_ev_t>::const_iterator
-					b = a->midi.begin();
-					b != a->midi.end(); ++b) {
-				printf("    MIDI: n(%d) v(%d) @ %" PRIu64 ", %" PRIu64 "\n",
-					b->note, b->velocity,
-					b->pos, b->length);
-			}
-		}
-
-		printf("\nTrack name (Track#) (Region#) @ Absolute:\n");
-		for (vector<PTFFormat::track_t>::const_iterator
-				a = ptf.tracks().begin();
-				a != ptf.tracks().end(); ++a) {
-			printf("`%s` t(%d) r(%d) @ %" PRIu64 "\n",
-				a->name.c_str(),
-				a->index,
-				a->reg.index,
-				a->reg.startpos);
-		}
-
-		printf("\nMIDI Track name (MIDITrack#) (MIDIRegion#) @ Absolute:\n");
-		for (vector<PTFFormat::track_t>::const_iterator
-				a = ptf.miditracks().begin();
-				a != ptf.miditracks().end(); ++a) {
-			printf("`%s` mt(%d) mr(%d) @ %" PRIu64 "\n",
-				a->name.c_str(),
-				a->index,
-				a->reg.index,
-				a->reg.startpos);
-		}
-
-		printf("\nTrack name (Track#) (WAV filename) @ Absolute + Into-sample, Length:\n");
-		for (vector<PTFFormat::track_t>::const_iterator
-				a = ptf.tracks().begin();
-				a != ptf.tracks().end(); ++a) {
-			printf("`%s` t(%d) (%s) @ %" PRIu64 " + %" PRIu64 ", %" PRIu64 "\n",
-				a->name.c_str(),
-				a->index,
-				a->reg.wave.filename.c_str(),
-				a->reg.startpos,
-				a->reg.sampleoffset,
-				a->reg.length
-				);
-		}
-		break;
+	if (archive.archive()) {
+		ok = ptf.load(archive, 48000);
+	} else {
+		ok = ptf.load(argv[1], 48000);
 	}
-	exit(0);
+
+	fputs(ptf_report(ptf, ok, 48000).c_str(), stdout);
+	exit(ok ? -1 : 0);
 }
@@ -22,43 +22,350 @@
 #include "ptformat/ptformat.h"
 #include <inttypes.h> // PRIx
 #include <cstdio>
+#include <cstring>
+#include <cmath>
 #include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
 
 using namespace std;
 using std::string;
 
+#define AUDIO_DIR	"Audio Files"
+#define TONE_HZ		1000
+#define TONE_GAIN_DB	-18.0
+#define CHUNK_SAMPLES	0x10000
+
+struct job_t {
+	PTFFormat *ptf;
+	bool silent;
+	pthread_mutex_t lock;
+	size_t next;
+	int written;
+	int skipped;
+	int failed;
+};
+
+static void
+put_le(unsigned char *p, uint32_t v, int n)
+{
+	for (int i = 0; i < n; i++)
+		p[i] = (v >> (8 * i)) & 0xff;
+}
+
+static void
+put_be(unsigned char *p, uint32_t v, int n)
+{
+	for (int i = 0; i < n; i++)
+		p[i] = (v >> (8 * (n - 1 - i))) & 0xff;
+}
+
+static bool
+is_aiff(string const& name)
+{
+	size_t dot = name.rfind('.');
+	if (dot == string::npos)
+		return false;
+	string ext = name.substr(dot + 1);
+	for (size_t i = 0; i < ext.size(); i++)
+		ext[i] = tolower(ext[i]);
+	return ext == "aif" || ext == "aiff";
+}
+
+/* Mono 16 bit header, returns its size */
+static size_t
+make_header(unsigned char *h, bool aiff, uint32_t rate, uint32_t frames)
+{
+	uint32_t data = frames * 2;
+
+	if (!aiff) {
+		memcpy(h, "RIFF", 4);
+		put_le(h+4, 36 + data, 4);
+		memcpy(h+8, "WAVEfmt ", 8);
+		put_le(h+16, 16, 4);
+		put_le(h+20, 1, 2);		// PCM
+		put_le(h+22, 1, 2);		// channels
+		put_le(h+24, rate, 4);
+		put_le(h+28, rate * 2, 4);
+		put_le(h+32, 2, 2);		// block align
+		put_le(h+34, 16, 2);
+		memcpy(h+36, "data", 4);
+		put_le(h+40, data, 4);
+		return 44;
+	}
+
+	/* Sample rate is an 80 bit extended float */
+	int e = 0;
+	while (e < 31 && (rate >> (e + 1)))
+		e++;
+	memcpy(h, "FORM", 4);
+	put_be(h+4, 46 + data, 4);
+	memcpy(h+8, "AIFFCOMM", 8);
+	put_be(h+16, 18, 4);
+	put_be(h+20, 1, 2);		// channels
+	put_be(h+22, frames, 4);
+	put_be(h+26, 16, 2);
+	put_be(h+28, 16383 + e, 2);
+	put_be(h+30, rate << (31 - e), 4);
+	put_be(h+34, 0, 4);
+	memcpy(h+38, "SSND", 4);
+	put_be(h+42, 8 + data, 4);
+	put_be(h+46, 0, 4);		// offset
+	put_be(h+50, 0, 4);		// block size
+	return 54;
+}
+
+static uint32_t
+gcd(uint32_t a, uint32_t b)
+{
+	while (b) {
+		uint32_t t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+/* Fill buf with whole periods of the tone, returns the number of
+ * samples filled so that consecutive writes of buf stay in phase */
+static uint32_t
+fill_tone(unsigned char *buf, bool aiff, uint32_t rate)
+{
+	uint32_t period = rate / gcd(rate, TONE_HZ);
+	uint32_t n = period * (CHUNK_SAMPLES / period);
+	double amp = 32767.0 * pow(10.0, TONE_GAIN_DB / 20.0);
+	uint32_t i;
+
+	if (n == 0)
+		n = period;
+	for (i = 0; i < period; i++) {
+		int16_t v = (int16_t)lrint(amp * sin(2.0 * M_PI * TONE_HZ * i / rate));
+		if (aiff)
+			put_be(buf + 2*i, (uint16_t)v, 2);
+		else
+			put_le(buf + 2*i, (uint16_t)v, 2);
+	}
+	/* The rest is copies of the first period */
+	for (i = period; i < n; i *= 2)
+		memcpy(buf + 2*i, buf, 2 * min(i, n - i));
+	return n;
+}
+
+static bool
+write_all(int fd, const unsigned char *p, size_t n)
+{
+	while (n) {
+		ssize_t w = write(fd, p, n);
+		if (w < 0) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		p += w;
+		n -= w;
+	}
+	return true;
+}
+
+/* Returns 1 written, 0 already there, -1 on error */
+static int
+write_placeholder(string const& path, bool aiff, bool silent, uint32_t rate,
+		uint32_t frames, unsigned char *buf, uint32_t bufframes)
+{
+	unsigned char h[54];
+	size_t hlen = make_header(h, aiff, rate, frames);
+	uint64_t left = frames;
+	bool ok;
+	int fd;
+
+	if ((fd = open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644)) < 0) {
+		return errno == EEXIST ? 0 : -1;
+	}
+
+	ok = write_all(fd, h, hlen);
+	if (ok && silent) {
+		/* Let the filesystem leave a hole instead of writing zeros */
+		ok = ftruncate(fd, hlen + 2 * (off_t)frames) == 0;
+	}
+	while (ok && !silent && left) {
+		uint32_t n = (uint32_t)min(left, (uint64_t)bufframes);
+		ok = write_all(fd, buf, 2 * n);
+		left -= n;
+	}
+	if (close(fd) || !ok) {
+		unlink(path.c_str());
+		return -1;
+	}
+	return 1;
+}
+
+static void *
+worker(void *arg)
+{
+	job_t *job = (job_t *)arg;
+	vector<PTFFormat::wav_t> const& wavs = job->ptf->audiofiles();
+	uint32_t rate = (uint32_t)job->ptf->sessionrate();
+	unsigned char *buf[2] = { NULL, NULL };
+	uint32_t bufframes[2] = { 0, 0 };
+
+	for (;;) {
+		size_t i;
+		pthread_mutex_lock(&job->lock);
+		i = job->next++;
+		pthread_mutex_unlock(&job->lock);
+		if (i >= wavs.size())
+			break;
+
+		PTFFormat::wav_t const& w = wavs[i];
+		bool aiff = is_aiff(w.filename);
+		int ret;
+
+		if (!w.length) {
+			pthread_mutex_lock(&job->lock);
+			fprintf(stderr, "unknown length : %s\n", w.filename.c_str());
+			job->skipped++;
+			pthread_mutex_unlock(&job->lock);
+			continue;
+		}
+		if (w.length > (UINT32_MAX - 54) / 2) {
+			ret = -1;
+			errno = EFBIG;
+		} else {
+			/* One tone buffer per byte order, built on first use */
+			if (!job->silent && !buf[aiff]) {
+				uint32_t period = rate / gcd(rate, TONE_HZ);
+				buf[aiff] = (unsigned char *)malloc(2 * max(period, (uint32_t)CHUNK_SAMPLES));
+				if (buf[aiff])
+					bufframes[aiff] = fill_tone(buf[aiff], aiff, rate);
+			}
+			if (!job->silent && !buf[aiff]) {
+				ret = -1;
+				errno = ENOMEM;
+			} else {
+				ret = write_placeholder(string(AUDIO_DIR "/") + w.filename,
+						aiff, job->silent, rate, (uint32_t)w.length,
+						buf[aiff], bufframes[aiff]);
+			}
+		}
+
+		pthread_mutex_lock(&job->lock);
+		if (ret > 0) {
+			job->written++;
+		} else if (ret == 0) {
+			job->skipped++;
+		} else {
+			fprintf(stderr, "cannot write %s: %s\n", w.filename.c_str(), strerror(errno));
+			job->failed++;
+		}
+		pthread_mutex_unlock(&job->lock);
+	}
+	free(buf[0]);
+	free(buf[1]);
+	return NULL;
+}
+
+static void
+print_script(PTFFormat& ptf)
+{
+	printf("#!/bin/bash\nset -e\nmkdir \"Audio Files\"\n");
+	for (vector<PTFFormat::wav_t>::const_iterator a = ptf.audiofiles().begin();
+				a != ptf.audiofiles().end(); ++a) {
+		if (!a->length) {
+			printf("# unknown length : %s\n", a->filename.c_str());
+		} else {
+			printf("sox --no-clobber -S -n -r %" PRId64 " -c 1 -b 16 \"Audio Files\"/\"%s\" synth %" PRId64 "s sine 1000 gain -18\n",
+				ptf.sessionrate(),
+				a->filename.c_str(),
+				a->length
+			);
+		}
+	}
+}
+
+static void
+usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-s] [-z] [-j jobs] file.pt{s,5,f,x}\n"
+		"Writes a mono 16 bit 1kHz tone at -18dB for every audio file\n"
+		"of the session into \"" AUDIO_DIR "\", leaving existing files alone.\n"
+		"  -s       print a sox script instead\n"
+		"  -z       write silence (sparse files where supported)\n"
+		"  -j jobs  number of files written at once (default: cpus)\n", prog);
+}
+
 int main (int argc, char **argv) {
 	PTFFormat ptf;
-	int ok;
+	bool script = false;
+	long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	job_t job;
+	int ok, c;
 
-	if (argc == 1) {
+	job.silent = false;
+	while ((c = getopt(argc, argv, "szj:h")) != -1) {
+		switch (c) {
+		case 's':
+			script = true;
+			break;
+		case 'z':
+			job.silent = true;
+			break;
+		case 'j':
+			jobs = atol(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			exit(1);
+		}
+	}
+
+	if (optind >= argc) {
 		printf("No ptf file specified, quit\n");
 		exit(0);
 	}
 
-	ok = ptf.load(argv[1], 48000);
+	/* Lengths are only meaningful at the session's own rate */
+	ok = ptf.load(argv[optind]);
 
-	switch (ok) {
-	default:
-	case -1:
+	if (ok) {
 		printf("Cannot open ptf, quit\n");
 		exit(-1);
-		break;
-	case 0:
-		printf("#!/bin/bash\nset -e\nmkdir \"Audio Files\"\n");
-		for (vector<PTFFormat::wav_t>::const_iterator a = ptf.audiofiles().begin();
-					a != ptf.audiofiles().end(); ++a) {
-			if (!a->length) {
-				printf("# unknown length : %s\n", a->filename.c_str());
-			} else {
-				printf("sox --no-clobber -S -n -r %" PRId64 " -c 1 -b 16 \"Audio Files\"/\"%s\" synth %" PRId64 "s sine 1000 gain -18\n",
-					ptf.sessionrate(),
-					a->filename.c_str(),
-					a->length
-				);
-			}
-		}
-		break;
 	}
-	exit(0);
+
+	if (script) {
+		print_script(ptf);
+		exit(0);
+	}
+
+	if (mkdir(AUDIO_DIR, 0755) && errno != EEXIST) {
+		fprintf(stderr, "cannot create " AUDIO_DIR ": %s\n", strerror(errno));
+		exit(1);
+	}
+
+	if (jobs < 1)
+		jobs = 1;
+	if ((size_t)jobs > ptf.audiofiles().size())
+		jobs = max((size_t)1, ptf.audiofiles().size());
+
+	job.ptf = &ptf;
+	job.next = 0;
+	job.written = job.skipped = job.failed = 0;
+	pthread_mutex_init(&job.lock, NULL);
+
+	vector<pthread_t> threads(jobs);
+	long started;
+	for (started = 0; started < jobs; started++) {
+		if (pthread_create(&threads[started], NULL, worker, &job))
+			break;
+	}
+	if (started == 0)
+		worker(&job);
+	for (long t = 0; t < started; t++)
+		pthread_join(threads[t], NULL);
+	pthread_mutex_destroy(&job.lock);
+
+	printf("%d written, %d skipped, %d failed\n", job.written, job.skipped, job.failed);
+	exit(job.failed ? 1 : 0);
 }
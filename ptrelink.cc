@@ -0,0 +1,383 @@
+/*
+ * libptformat - a library to read ProTools sessions
+ *
+ * Copyright (C) 2015  Damien Zammit
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include "ptformat/ptformat.h"
+#include <cstdio>
+#include <cstring>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+using namespace std;
+using std::string;
+
+#define CACHE_NAME	".ptrelink-index"
+#define CACHE_MAGIC	"ptrelink-index 1"
+
+struct dir_t {
+	string path;
+	long mtime;
+};
+
+struct file_t {
+	string key;	// case folded, .wav/.aif/.aiff dropped
+	string path;
+	bool operator<(file_t const& o) const {
+		return key < o.key || (key == o.key && path < o.path);
+	}
+};
+
+/* Shared state of the parallel directory walk */
+struct walk_t {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	vector<string> todo;
+	int busy;
+	vector<dir_t> dirs;
+	vector<file_t> files;
+};
+
+static string
+fold(string s)
+{
+	for (size_t i = 0; i < s.size(); i++)
+		s[i] = tolower((unsigned char)s[i]);
+	return s;
+}
+
+/* Key a name is looked up by, so that foo.WAV, foo.aif and foo.aiff
+ * all land on the same entry */
+static string
+make_key(string const& name)
+{
+	string k = fold(name);
+	size_t dot = k.rfind('.');
+	if (dot != string::npos) {
+		string ext = k.substr(dot + 1);
+		if (ext == "wav" || ext == "aif" || ext == "aiff")
+			k.erase(dot);
+	}
+	return k;
+}
+
+static string
+basename_of(string const& path)
+{
+	size_t slash = path.rfind('/');
+	return slash == string::npos ? path : path.substr(slash + 1);
+}
+
+static void
+scan_dir(string const& path, vector<string>& subdirs, vector<dir_t>& dirs, vector<file_t>& files)
+{
+	DIR *d;
+	struct dirent *e;
+	struct stat st;
+
+	if (stat(path.c_str(), &st) || !(d = opendir(path.c_str())))
+		return;
+	dir_t dir = { path, (long)st.st_mtime };
+	dirs.push_back(dir);
+
+	while ((e = readdir(d))) {
+		if (!strcmp(e->d_name, ".") || !strcmp(e->d_name, "..") ||
+				!strcmp(e->d_name, CACHE_NAME))
+			continue;
+		string p = path + "/" + e->d_name;
+		bool isdir = false, isfile = false;
+#ifdef DT_DIR
+		if (e->d_type == DT_DIR) {
+			isdir = true;
+		} else if (e->d_type == DT_REG) {
+			isfile = true;
+		} else if (e->d_type == DT_LNK) {
+			/* Follow links to files but not to directories */
+			isfile = !stat(p.c_str(), &st) && S_ISREG(st.st_mode);
+		} else
+#endif
+		if (!lstat(p.c_str(), &st)) {
+			isdir = S_ISDIR(st.st_mode);
+			isfile = S_ISREG(st.st_mode) ||
+				(S_ISLNK(st.st_mode) && !stat(p.c_str(), &st) && S_ISREG(st.st_mode));
+		}
+		if (isdir) {
+			subdirs.push_back(p);
+		} else if (isfile && !strchr(e->d_name, '\n')) {
+			files.push_back(file_t());
+			files.back().key = make_key(e->d_name);
+			files.back().path = p;
+		}
+	}
+	closedir(d);
+}
+
+static void *
+walker(void *arg)
+{
+	walk_t *w = (walk_t *)arg;
+	vector<string> subdirs;
+	vector<dir_t> dirs;
+	vector<file_t> files;
+
+	pthread_mutex_lock(&w->lock);
+	for (;;) {
+		while (w->todo.empty() && w->busy)
+			pthread_cond_wait(&w->cond, &w->lock);
+		if (w->todo.empty())
+			break;
+		string path = w->todo.back();
+		w->todo.pop_back();
+		w->busy++;
+		pthread_mutex_unlock(&w->lock);
+
+		subdirs.clear();
+		scan_dir(path, subdirs, dirs, files);
+
+		pthread_mutex_lock(&w->lock);
+		w->todo.insert(w->todo.end(), subdirs.begin(), subdirs.end());
+		w->busy--;
+		pthread_cond_broadcast(&w->cond);
+	}
+	w->dirs.insert(w->dirs.end(), dirs.begin(), dirs.end());
+	w->files.insert(w->files.end(), files.begin(), files.end());
+	pthread_mutex_unlock(&w->lock);
+	return NULL;
+}
+
+static void
+walk(string const& root, long jobs, vector<dir_t>& dirs, vector<file_t>& files)
+{
+	walk_t w;
+	vector<pthread_t> threads(jobs);
+	long started;
+
+	pthread_mutex_init(&w.lock, NULL);
+	pthread_cond_init(&w.cond, NULL);
+	w.todo.push_back(root);
+	w.busy = 0;
+
+	for (started = 0; started < jobs; started++) {
+		if (pthread_create(&threads[started], NULL, walker, &w))
+			break;
+	}
+	if (started == 0)
+		walker(&w);
+	for (long t = 0; t < started; t++)
+		pthread_join(threads[t], NULL);
+
+	pthread_cond_destroy(&w.cond);
+	pthread_mutex_destroy(&w.lock);
+	dirs.swap(w.dirs);
+	files.swap(w.files);
+}
+
+/* The cache is only used when no directory was touched since it was
+ * written, as adding, removing or renaming an entry updates the mtime
+ * of the directory that holds it */
+static bool
+read_cache(string const& cache, string const& root, vector<dir_t>& dirs, vector<file_t>& files)
+{
+	FILE *fp;
+	char line[4096];
+	long written = 0;
+	bool ok = false;
+	struct stat st;
+
+	if (!(fp = fopen(cache.c_str(), "r")))
+		return false;
+	if (!fgets(line, sizeof(line), fp) || strncmp(line, CACHE_MAGIC "\n", sizeof(line)))
+		goto out;
+	if (!fgets(line, sizeof(line), fp) || string(line) != root + "\n")
+		goto out;
+	if (!fgets(line, sizeof(line), fp) || sscanf(line, "%ld", &written) != 1)
+		goto out;
+
+	while (fgets(line, sizeof(line), fp)) {
+		size_t len = strlen(line);
+		if (len < 3 || line[len - 1] != '\n')
+			goto out;
+		line[len - 1] = '\0';
+		if (line[0] == 'D') {
+			dir_t d;
+			char *p;
+			d.mtime = strtol(line + 2, &p, 10);
+			if (*p != ' ')
+				goto out;
+			d.path = p + 1;
+			if (stat(d.path.c_str(), &st) || (long)st.st_mtime != d.mtime ||
+					d.mtime >= written)
+				goto out;
+			dirs.push_back(d);
+		} else if (line[0] == 'F') {
+			files.push_back(file_t());
+			files.back().path = line + 2;
+			files.back().key = make_key(basename_of(files.back().path));
+		} else {
+			goto out;
+		}
+	}
+	ok = !ferror(fp);
+out:
+	fclose(fp);
+	if (!ok) {
+		dirs.clear();
+		files.clear();
+	}
+	return ok;
+}
+
+static void
+write_cache(string const& cache, string const& root, long started,
+		vector<dir_t> const& dirs, vector<file_t> const& files)
+{
+	string tmp = cache + ".tmp";
+	FILE *fp;
+	size_t i;
+
+	if (!(fp = fopen(tmp.c_str(), "w")))
+		return;
+	fprintf(fp, CACHE_MAGIC "\n%s\n%ld\n", root.c_str(), started);
+	for (i = 0; i < dirs.size(); i++)
+		fprintf(fp, "D %ld %s\n", dirs[i].mtime, dirs[i].path.c_str());
+	for (i = 0; i < files.size(); i++)
+		fprintf(fp, "F %s\n", files[i].path.c_str());
+	if (fclose(fp) || rename(tmp.c_str(), cache.c_str()))
+		unlink(tmp.c_str());
+}
+
+/* Higher is better: same name as the session asks for, then the file
+ * sitting in an "Audio Files" directory as PT lays sessions out */
+static int
+score(string const& want, string const& path)
+{
+	int s = 0;
+	size_t slash = path.rfind('/');
+	string name = path.substr(slash + 1);
+	if (fold(name) == want)
+		s += 2;
+	if (slash != string::npos) {
+		size_t up = path.rfind('/', slash - 1);
+		up = (up == string::npos) ? 0 : up + 1;
+		if (fold(path.substr(up, slash - up)) == "audio files")
+			s += 1;
+	}
+	return s;
+}
+
+static void
+usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-j jobs] [-c cache | -n] file.pt{s,5,f,x} mediadir\n"
+		"Prints every audio file of the session with where it was found\n"
+		"under mediadir, ignoring case and .wav/.aif swaps.\n"
+		"  -j jobs   directories scanned at once (default: cpus)\n"
+		"  -c cache  index cache file (default: mediadir/" CACHE_NAME ")\n"
+		"  -n        do not read or write the cache\n", prog);
+}
+
+int main (int argc, char **argv) {
+	PTFFormat ptf;
+	long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	bool usecache = true;
+	string cache, root;
+	vector<dir_t> dirs;
+	vector<file_t> files;
+	int c, missing = 0;
+
+	while ((c = getopt(argc, argv, "j:c:nh")) != -1) {
+		switch (c) {
+		case 'j':
+			jobs = atol(optarg);
+			break;
+		case 'c':
+			cache = optarg;
+			break;
+		case 'n':
+			usecache = false;
+			break;
+		default:
+			usage(argv[0]);
+			exit(2);
+		}
+	}
+	if (argc - optind < 2) {
+		usage(argv[0]);
+		exit(2);
+	}
+	if (jobs < 1)
+		jobs = 1;
+
+	if (ptf.load(argv[optind])) {
+		fprintf(stderr, "Cannot load %s\n", argv[optind]);
+		exit(2);
+	}
+
+	root = argv[optind + 1];
+	while (root.size() > 1 && root[root.size() - 1] == '/')
+		root.erase(root.size() - 1);
+	if (cache.empty())
+		cache = root + "/" CACHE_NAME;
+
+	if (!usecache || !read_cache(cache, root, dirs, files)) {
+		long started = (long)time(NULL);
+		walk(root, jobs, dirs, files);
+		if (dirs.empty()) {
+			fprintf(stderr, "Cannot read %s\n", root.c_str());
+			exit(2);
+		}
+		if (usecache)
+			write_cache(cache, root, started, dirs, files);
+	}
+	sort(files.begin(), files.end());
+
+	/* Resolve the whole session against the index in one pass */
+	vector<PTFFormat::wav_t> const& wavs = ptf.audiofiles();
+	for (vector<PTFFormat::wav_t>::const_iterator a = wavs.begin(); a != wavs.end(); ++a) {
+		file_t k;
+		k.key = make_key(a->filename);
+		vector<file_t>::const_iterator i = lower_bound(files.begin(), files.end(), k);
+		vector<file_t>::const_iterator best = files.end();
+		string want = fold(a->filename);
+		int bestscore = -1;
+
+		for (; i != files.end() && i->key == k.key; ++i) {
+			int s = score(want, i->path);
+			if (s > bestscore) {
+				bestscore = s;
+				best = i;
+			}
+		}
+		if (best == files.end()) {
+			printf("%s\t\n", a->filename.c_str());
+			missing++;
+		} else {
+			printf("%s\t%s\n", a->filename.c_str(), best->path.c_str());
+		}
+	}
+
+	fprintf(stderr, "%zu found, %d missing, %zu files indexed\n",
+		wavs.size() - missing, missing, files.size());
+	exit(missing ? 1 : 0);
+}
@@ -20,30 +20,38 @@
  */
 #include <stdlib.h>
 #include <cstdio>
+#include <cstring>
 #include <inttypes.h>
 #include "ptformat/ptformat.h"
 
 int main(int argc, char** argv) {
-	
-	uint64_t i;
-	PTFFormat ptf;
+	FILE *in = stdin;
+	int ret;
 
 	if (argc < 2) {
-		fprintf(stderr, "Need filename\n");
+		fprintf(stderr, "Need filename, or - for stdin\n");
 		exit(1);
 	}
 
-	if (ptf.unxor(std::string(argv[1])) == -1) {
-		fprintf(stderr, "Can't decrypt pt session, still try to dump...\n");
+	if (strcmp(argv[1], "-") && !(in = fopen(argv[1], "rb"))) {
+		fprintf(stderr, "Can't open %s\n", argv[1]);
+		exit(1);
 	}
 
-	const unsigned char* unxored = ptf.unxored_data();
-	uint64_t len = ptf.unxored_size ();
+	/* Each decrypted chunk goes out in one write */
+	setvbuf(stdout, NULL, _IONBF, 0);
+
+	ret = PTFFormat::unxor_stream(in, stdout);
+	if (in != stdin) {
+		fclose(in);
+	}
 
-	if (unxored) {
-		for (i = 0; i < len; i++) {
-			printf("%c", unxored[i]);
-		}
+	if (ret == -1) {
+		fprintf(stderr, "Can't decrypt pt session\n");
+		exit(1);
+	} else if (ret == -2) {
+		fprintf(stderr, "Error writing output\n");
+		exit(1);
 	}
 
 	return 0;